@@ -3,35 +3,54 @@
  */
 
 #include "dbus-spy.h"
+#include "notification-markup.h"
 
 enum {
-  MESSAGE_RECEIVED,
+  MESSAGES_RECEIVED,
   LAST_SIGNAL
 };
 
-typedef struct _IdleMessage IdleMessage;
-struct _IdleMessage
-{
-  DBusSpy      *spy;
-  Notification *note;
-};
-
 static guint signals[LAST_SIGNAL];
 
 static void dbus_spy_class_init(DBusSpyClass *klass);
 static void dbus_spy_init(DBusSpy *self);
 static void dbus_spy_dispose(GObject *object);
+static void dbus_spy_finalize(GObject *object);
 
+static void start_monitor(DBusSpy *self);
+static void start_eavesdrop(DBusSpy *self);
 static void add_filter(DBusSpy *self);
-
+static gboolean handle_message(DBusSpy *self, GDBusMessage *message);
+static gboolean is_filtered(DBusSpy *self, GVariant *body);
+static void record_body(DBusSpy *self, GVariant *body);
+static void handle_notify_return(DBusSpy *self, GDBusMessage *message);
+static void pending_call_remove(DBusSpy *self, const gchar *key);
+static void queue_notification(DBusSpy *self, Notification *note);
+static gboolean queue_make_room(DBusSpy *self, Notification *note);
+
+static void get_address_thread(GTask *task, gpointer source_object, gpointer task_data,
+                               GCancellable *cancellable);
+static void get_address_cb(GObject *source_object, GAsyncResult *res, gpointer user_data);
+static void monitor_connection_cb(GObject *source_object, GAsyncResult *res, gpointer user_data);
+static void become_monitor_cb(GObject *source_object, GAsyncResult *res, gpointer user_data);
 static void bus_get_cb(GObject *source_object, GAsyncResult *res, gpointer user_data);
 
-static GDBusMessage *message_filter(GDBusConnection *connection, GDBusMessage *message, 
+static GDBusMessage *monitor_filter(GDBusConnection *connection, GDBusMessage *message,
+                                    gboolean incoming, gpointer user_data);
+static GDBusMessage *message_filter(GDBusConnection *connection, GDBusMessage *message,
                                     gboolean incoming, gpointer user_data);
 
-static gboolean idle_message_emit(gpointer user_data);
+static gboolean idle_messages_emit(gpointer user_data);
+
+#define MATCH_RULE "type='method_call',interface='org.freedesktop.Notifications',member='Notify'"
+#define MATCH_STRING "eavesdrop=true," MATCH_RULE
+
+/* Replies from the notification daemon carry the id it assigned */
+#define RETURN_MATCH_RULE "type='method_return',sender='org.freedesktop.Notifications'"
+#define RETURN_MATCH_STRING "eavesdrop=true," RETURN_MATCH_RULE
 
-#define MATCH_STRING "eavesdrop=true,type='method_call',interface='org.freedesktop.Notifications',member='Notify'"
+/* Forget the oldest calls once this many are waiting for their reply */
+#define PENDING_CALLS_MAX 64
 
 G_DEFINE_TYPE_WITH_PRIVATE(DBusSpy, dbus_spy, G_TYPE_OBJECT);
 
@@ -41,16 +60,180 @@ dbus_spy_class_init(DBusSpyClass *klass)
   GObjectClass *object_class = G_OBJECT_CLASS(klass);
 
   object_class->dispose = dbus_spy_dispose;
+  object_class->finalize = dbus_spy_finalize;
 
-  signals[MESSAGE_RECEIVED] =
-    g_signal_new(DBUS_SPY_SIGNAL_MESSAGE_RECEIVED,
+  /* The GPtrArray of Notification objects is owned by the spy, handlers
+   * should take a reference to any notification they keep. */
+  signals[MESSAGES_RECEIVED] =
+    g_signal_new(DBUS_SPY_SIGNAL_MESSAGES_RECEIVED,
                  G_TYPE_FROM_CLASS(klass),
                  G_SIGNAL_RUN_LAST,
-                 G_STRUCT_OFFSET(DBusSpyClass, message_received),
+                 G_STRUCT_OFFSET(DBusSpyClass, messages_received),
                  NULL, NULL,
-                 g_cclosure_marshal_VOID__OBJECT,
+                 g_cclosure_marshal_VOID__BOXED,
                  G_TYPE_NONE,
-                 1, NOTIFICATION_TYPE);
+                 1, G_TYPE_PTR_ARRAY);
+}
+
+/**
+ * start_monitor:
+ * @self: the dbus spy
+ *
+ * Opens a private connection to the session bus that will be turned into a
+ * monitor. The bus only forwards messages matching MATCH_RULE to a monitor, so
+ * unrelated traffic never reaches our filter. Looking up the address of the
+ * bus can block, so it is done in a thread.
+ **/
+static void
+start_monitor(DBusSpy *self)
+{
+  GTask *task = g_task_new(self, self->priv->connection_cancel, get_address_cb, NULL);
+
+  g_task_run_in_thread(task, get_address_thread);
+  g_object_unref(task);
+}
+
+/**
+ * get_address_thread:
+ * @task: the task
+ * @source_object: the dbus spy
+ * @task_data: unused
+ * @cancellable: the spy's connection_cancel
+ *
+ * Looks up the address of the session bus. Runs in a GTask thread.
+ **/
+static void
+get_address_thread(GTask *task, G_GNUC_UNUSED gpointer source_object, G_GNUC_UNUSED gpointer task_data,
+                   GCancellable *cancellable)
+{
+  GError *error = NULL;
+  gchar *address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, cancellable, &error);
+
+  if(error != NULL)
+    g_task_return_error(task, error);
+  else
+    g_task_return_pointer(task, address, g_free);
+}
+
+static void
+get_address_cb(GObject *source_object, GAsyncResult *res, G_GNUC_UNUSED gpointer user_data)
+{
+  GError *error = NULL;
+
+  gchar *address = g_task_propagate_pointer(G_TASK(res), &error);
+
+  if(error != NULL) {
+    if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning("Could not get the address of the dbus session bus: %s", error->message);
+    g_error_free(error);
+    return;
+  }
+
+  DBusSpy *self = DBUS_SPY(source_object);
+  g_return_if_fail(self != NULL);
+
+  g_dbus_connection_new_for_address(address,
+                                    G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                    G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                    NULL,
+                                    self->priv->connection_cancel,
+                                    monitor_connection_cb,
+                                    self);
+
+  g_free(address);
+}
+
+/**
+ * start_eavesdrop:
+ * @self: the dbus spy
+ *
+ * Falls back to eavesdropping on the shared session bus connection, for
+ * brokers that do not implement org.freedesktop.DBus.Monitoring.
+ **/
+static void
+start_eavesdrop(DBusSpy *self)
+{
+  g_bus_get(G_BUS_TYPE_SESSION,
+            self->priv->connection_cancel,
+            bus_get_cb,
+            self);
+}
+
+static void
+monitor_connection_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GError *error = NULL;
+
+  GDBusConnection *connection = g_dbus_connection_new_for_address_finish(res, &error);
+
+  if(error != NULL) {
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_error_free(error);
+      return;
+    }
+
+    g_warning("Could not open a monitor connection to the dbus session bus: %s", error->message);
+    g_error_free(error);
+    start_eavesdrop(DBUS_SPY(user_data));
+    return;
+  }
+
+  DBusSpy *self = DBUS_SPY(user_data);
+  g_return_if_fail(self != NULL);
+
+  const gchar *rules[] = { MATCH_RULE, RETURN_MATCH_RULE, NULL };
+
+  self->priv->connection = connection;
+  self->priv->is_monitor = TRUE;
+
+  /* The filter has to be in place before the bus starts forwarding messages */
+  self->priv->filter_id = g_dbus_connection_add_filter(connection, monitor_filter, self, NULL);
+
+  g_dbus_connection_call(connection,
+                         "org.freedesktop.DBus",
+                         "/org/freedesktop/DBus",
+                         "org.freedesktop.DBus.Monitoring",
+                         "BecomeMonitor",
+                         g_variant_new("(^asu)", rules, 0),
+                         NULL,
+                         G_DBUS_CALL_FLAGS_NONE,
+                         -1,
+                         self->priv->connection_cancel,
+                         become_monitor_cb,
+                         self);
+}
+
+static void
+become_monitor_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  GError *error = NULL;
+
+  GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source_object), res, &error);
+
+  if(error != NULL) {
+    if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_error_free(error);
+      return;
+    }
+
+    g_message("Could not become a dbus monitor, falling back to eavesdropping: %s", error->message);
+    g_error_free(error);
+
+    DBusSpy *self = DBUS_SPY(user_data);
+    g_return_if_fail(self != NULL);
+
+    g_dbus_connection_remove_filter(self->priv->connection, self->priv->filter_id);
+    self->priv->filter_id = 0;
+    g_dbus_connection_close(self->priv->connection, NULL, NULL, NULL);
+    g_object_unref(self->priv->connection);
+    self->priv->connection = NULL;
+    self->priv->is_monitor = FALSE;
+
+    start_eavesdrop(self);
+    return;
+  }
+
+  g_variant_unref(result);
 }
 
 static void
@@ -69,11 +252,6 @@ bus_get_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
   DBusSpy *self = DBUS_SPY(user_data);
   g_return_if_fail(self != NULL);
 
-  if(self->priv->connection_cancel != NULL) {
-    g_object_unref(self->priv->connection_cancel);
-    self->priv->connection_cancel = NULL;
-  }
-
   self->priv->connection = connection;
 
   add_filter(self);
@@ -82,36 +260,51 @@ bus_get_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
 static void
 add_filter(DBusSpy *self)
 {
+  const gchar *rules[] = { MATCH_STRING, RETURN_MATCH_STRING };
   GDBusMessage *message;
   GVariant *body;
   GError *error = NULL;
+  guint i;
 
-  message = g_dbus_message_new_method_call("org.freedesktop.DBus", "/org/freedesktop/DBus",
-      "org.freedesktop.DBus", "AddMatch");
+  for(i = 0; i < G_N_ELEMENTS(rules); i++) {
+    message = g_dbus_message_new_method_call("org.freedesktop.DBus", "/org/freedesktop/DBus",
+        "org.freedesktop.DBus", "AddMatch");
 
-  body = g_variant_new_parsed("(%s,)", MATCH_STRING);
+    body = g_variant_new_parsed("(%s,)", rules[i]);
 
-  g_dbus_message_set_body(message, body);
-  
-  g_dbus_connection_send_message(self->priv->connection, 
-                                 message, 
-                                 G_DBUS_SEND_MESSAGE_FLAGS_NONE, 
-                                 NULL, 
-                                 &error);
-  if(error != NULL) {
-    g_warning("Failed to send AddMatch message: %s\n", error->message);
-    g_error_free(error);
-    return;
+    g_dbus_message_set_body(message, body);
+
+    g_dbus_connection_send_message(self->priv->connection,
+                                   message,
+                                   G_DBUS_SEND_MESSAGE_FLAGS_NONE,
+                                   NULL,
+                                   &error);
+    g_object_unref(message);
+
+    if(error != NULL) {
+      g_warning("Failed to send AddMatch message: %s\n", error->message);
+      g_error_free(error);
+      return;
+    }
   }
 
-  g_dbus_connection_add_filter(self->priv->connection, message_filter, self, NULL);
+  self->priv->filter_id = g_dbus_connection_add_filter(self->priv->connection, message_filter, self, NULL);
 }
 
-static GDBusMessage* 
-message_filter(GDBusConnection *connection, GDBusMessage *message, gboolean incoming, gpointer user_data)
+/**
+ * handle_message:
+ * @self: the dbus spy
+ * @message: a message seen on the bus
+ *
+ * Queues a notification for the main loop if the message is a Notify call.
+ * Runs in the GDBus worker thread, which also renders the markup so the main
+ * loop only has to update widgets.
+ *
+ * Returns: TRUE if the message was a Notify call.
+ **/
+static gboolean
+handle_message(DBusSpy *self, GDBusMessage *message)
 {
-  if(!incoming) return message;
-
   GDBusMessageType type = g_dbus_message_get_message_type(message);
   const gchar *interface = g_dbus_message_get_interface(message);
   const gchar *member = g_dbus_message_get_member(message);
@@ -120,27 +313,319 @@ message_filter(GDBusConnection *connection, GDBusMessage *message, gboolean inco
       && (g_strcmp0(interface, "org.freedesktop.Notifications") == 0)
       && (g_strcmp0(member, "Notify") == 0))
   {
-    DBusSpy *spy = DBUS_SPY(user_data);
+    if(g_atomic_pointer_get(&self->priv->recorder) != NULL)
+      record_body(self, g_dbus_message_get_body(message));
+
+    /* Discard notifications on the filter list before unpacking anything */
+    if(is_filtered(self, g_dbus_message_get_body(message)))
+      return TRUE;
+
     Notification *note = notification_new_from_dbus_message(message);
-    IdleMessage *im = g_new0(IdleMessage, 1);
-    im->spy = spy;
-    im->note = note;
-    g_idle_add(idle_message_emit, im);
+
+    if(note == NULL) {
+      g_atomic_int_inc(&self->priv->malformed_count);
+      g_debug("Discarding a malformed Notify call from %s", g_dbus_message_get_sender(message));
+      return TRUE;
+    }
+
+    /* Discard useless notifications */
+    if(notification_is_private(note) || notification_is_empty(note)) {
+      notification_unref(note);
+      return TRUE;
+    }
+
+    notification_set_markup(note, notification_markup_new(note));
+
+    /* Remember the call so the id can be picked up from the reply */
+    if(g_dbus_message_get_sender(message) != NULL) {
+      gchar *key = g_strdup_printf("%s %u", g_dbus_message_get_sender(message),
+                                   g_dbus_message_get_serial(message));
+
+      pending_call_remove(self, key);
+
+      /* The reply to the oldest call is the most likely to have been missed */
+      if(g_hash_table_size(self->priv->pending_calls) >= PENDING_CALLS_MAX)
+        pending_call_remove(self, g_queue_peek_head(&self->priv->pending_order));
+
+      g_hash_table_insert(self->priv->pending_calls, key, notification_ref(note));
+      g_queue_push_tail(&self->priv->pending_order, key);
+    }
+
+    queue_notification(self, note);
+    return TRUE;
+  }
+
+  if(type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    handle_notify_return(self, message);
+
+  return FALSE;
+}
+
+/**
+ * is_filtered:
+ * @self: the dbus spy
+ * @body: the body of a Notify call
+ *
+ * Checks the application name against the filter list before the rest of the
+ * body is unpacked. The name is borrowed from the body with the "&s" format,
+ * so nothing is allocated or copied.
+ *
+ * Returns: TRUE if the application is on the filter list.
+ **/
+static gboolean
+is_filtered(DBusSpy *self, GVariant *body)
+{
+  const gchar *app_name;
+  gboolean filtered = FALSE;
+
+  if(body == NULL || !g_variant_is_of_type(body, G_VARIANT_TYPE(NOTIFICATION_NOTIFY_SIGNATURE)))
+    return FALSE;
+
+  g_variant_get_child(body, 0, "&s", &app_name);
+
+  g_mutex_lock(&self->priv->filter_lock);
+  if(self->priv->filter_set != NULL)
+    filtered = g_hash_table_contains(self->priv->filter_set, app_name);
+  g_mutex_unlock(&self->priv->filter_lock);
+
+  return filtered;
+}
+
+/**
+ * record_body:
+ * @self: the dbus spy
+ * @body: the body of a Notify call
+ *
+ * Appends the body to the recording, stopping the recording if the write fails.
+ **/
+static void
+record_body(DBusSpy *self, GVariant *body)
+{
+  g_mutex_lock(&self->priv->record_lock);
+
+  if(self->priv->recorder != NULL
+      && !notify_recorder_write(self->priv->recorder, g_get_monotonic_time(), body)) {
+    g_warning("Failed to write the notification recording, stopping it");
+    notify_recorder_free(self->priv->recorder);
+    g_atomic_pointer_set(&self->priv->recorder, NULL);
+  }
+
+  g_mutex_unlock(&self->priv->record_lock);
+}
+
+/**
+ * handle_notify_return:
+ * @self: the dbus spy
+ * @message: a method return seen on the bus
+ *
+ * If @message is the notification daemon's reply to a Notify call we saw,
+ * records the id it assigned on the notification. The reply is seen before
+ * any call that uses the id as replaces_id, so the id is usually set by then.
+ * It stays unset if the call was evicted from pending_calls before its reply
+ * came. Runs in the GDBus worker thread.
+ **/
+static void
+handle_notify_return(DBusSpy *self, GDBusMessage *message)
+{
+  const gchar *destination = g_dbus_message_get_destination(message);
+  GVariant *body = g_dbus_message_get_body(message);
+  Notification *note;
+  guint32 id;
+
+  if(destination == NULL || g_hash_table_size(self->priv->pending_calls) == 0)
+    return;
+
+  gchar *key = g_strdup_printf("%s %u", destination, g_dbus_message_get_reply_serial(message));
+
+  note = g_hash_table_lookup(self->priv->pending_calls, key);
+
+  if(note != NULL) {
+    if(body != NULL && g_variant_is_of_type(body, G_VARIANT_TYPE("(u)"))) {
+      g_variant_get(body, "(u)", &id);
+      notification_set_id(note, id);
+    }
+    pending_call_remove(self, key);
+  }
+
+  g_free(key);
+}
+
+/**
+ * pending_call_remove:
+ * @self: the dbus spy
+ * @key: the "sender serial" key of a Notify call
+ *
+ * Forgets a call waiting for its reply, if there is one. Runs in the GDBus
+ * worker thread.
+ **/
+static void
+pending_call_remove(DBusSpy *self, const gchar *key)
+{
+  gpointer pending_key;
+
+  if(g_hash_table_lookup_extended(self->priv->pending_calls, key, &pending_key, NULL)) {
+    g_queue_remove(&self->priv->pending_order, pending_key);
+    g_hash_table_remove(self->priv->pending_calls, pending_key);
+  }
+}
+
+/**
+ * queue_notification:
+ * @self: the dbus spy
+ * @note: the notification, ownership is transferred to the queue
+ *
+ * Adds a notification to the queue and makes sure the main loop will drain
+ * it. Only one idle source is pending at a time, so a burst of notifications
+ * is delivered as a single batch. Runs in the GDBus worker thread.
+ **/
+static void
+queue_notification(DBusSpy *self, Notification *note)
+{
+  g_mutex_lock(&self->priv->queue_lock);
+
+  if(self->priv->queue == NULL) {
+    /* Already disposed */
+    g_mutex_unlock(&self->priv->queue_lock);
+    notification_unref(note);
+    return;
+  }
+
+  if(!queue_make_room(self, note)) {
+    g_mutex_unlock(&self->priv->queue_lock);
+    notification_unref(note);
+    return;
+  }
+
+  g_queue_push_tail(self->priv->queue, note);
+
+  if(self->priv->idle_id == 0)
+    self->priv->idle_id = g_idle_add(idle_messages_emit, self);
+
+  g_mutex_unlock(&self->priv->queue_lock);
+}
+
+/**
+ * queue_make_room:
+ * @self: the dbus spy
+ * @note: the notification about to be queued
+ *
+ * Applies the overflow policy when the queue is full. Must be called with
+ * queue_lock held.
+ *
+ * Returns: FALSE if @note should be dropped instead of queued.
+ **/
+static gboolean
+queue_make_room(DBusSpy *self, Notification *note)
+{
+  GQueue *queue = self->priv->queue;
+  GList *item;
+
+  if(g_queue_get_length(queue) < self->priv->queue_limit)
+    return TRUE;
+
+  switch(self->priv->overflow_policy) {
+    case DBUS_SPY_OVERFLOW_DROP_NEWEST:
+      self->priv->dropped_newest++;
+      return FALSE;
+
+    case DBUS_SPY_OVERFLOW_COLLAPSE_PER_APP:
+      /* Replace the oldest queued notification from the same application,
+       * the names are interned so they can be compared by pointer */
+      for(item = queue->head; item != NULL; item = item->next) {
+        if(notification_get_app_name(item->data) == notification_get_app_name(note)) {
+          notification_unref(item->data);
+          g_queue_delete_link(queue, item);
+          self->priv->collapsed++;
+          return TRUE;
+        }
+      }
+      /* Nothing to collapse, so drop the oldest instead */
+      /* fall through */
+
+    case DBUS_SPY_OVERFLOW_DROP_OLDEST:
+    default:
+      while(g_queue_get_length(queue) >= self->priv->queue_limit) {
+        notification_unref(g_queue_pop_head(queue));
+        self->priv->dropped_oldest++;
+      }
+      return TRUE;
+  }
+}
+
+static GDBusMessage*
+monitor_filter(GDBusConnection *connection, GDBusMessage *message, gboolean incoming, gpointer user_data)
+{
+  if(!incoming) return message;
+
+  /* Let the replies to our own calls (such as BecomeMonitor) through */
+  GDBusMessageType type = g_dbus_message_get_message_type(message);
+
+  if(((type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) || (type == G_DBUS_MESSAGE_TYPE_ERROR))
+      && (g_strcmp0(g_dbus_message_get_destination(message),
+                    g_dbus_connection_get_unique_name(connection)) == 0)) {
+    return message;
+  }
+
+  /* A monitor must never reply to the messages it sees, so consume everything
+   * else before GDBus tries to dispatch it. */
+  handle_message(DBUS_SPY(user_data), message);
+  g_object_unref(message);
+
+  return NULL;
+}
+
+static GDBusMessage*
+message_filter(GDBusConnection *connection, GDBusMessage *message, gboolean incoming, gpointer user_data)
+{
+  if(!incoming) return message;
+
+  if(handle_message(DBUS_SPY(user_data), message)) {
+    g_object_unref(message);
+    return NULL;
+  }
+
+  /* GDBus matches replies by serial alone, so consume the eavesdropped replies
+   * to other clients before one completes a call of ours with the same serial */
+  GDBusMessageType type = g_dbus_message_get_message_type(message);
+
+  if(((type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) || (type == G_DBUS_MESSAGE_TYPE_ERROR))
+      && (g_strcmp0(g_dbus_message_get_destination(message),
+                    g_dbus_connection_get_unique_name(connection)) != 0)) {
     g_object_unref(message);
-    message = NULL;
+    return NULL;
   }
 
   return message;
 }
 
+/**
+ * idle_messages_emit:
+ * @user_data: the dbus spy
+ *
+ * Drains the queue and emits everything that arrived since the last call as
+ * one batch.
+ **/
 static gboolean
-idle_message_emit(gpointer user_data)
+idle_messages_emit(gpointer user_data)
 {
-  IdleMessage *message = (IdleMessage *)user_data;
+  DBusSpy *self = DBUS_SPY(user_data);
+  GPtrArray *notes;
+
+  g_mutex_lock(&self->priv->queue_lock);
+
+  notes = g_ptr_array_new_full(g_queue_get_length(self->priv->queue),
+                               (GDestroyNotify) notification_unref);
+  while(!g_queue_is_empty(self->priv->queue)) {
+    g_ptr_array_add(notes, g_queue_pop_head(self->priv->queue));
+  }
+  self->priv->idle_id = 0;
+
+  g_mutex_unlock(&self->priv->queue_lock);
 
-  g_signal_emit(message->spy, signals[MESSAGE_RECEIVED], 0, message->note);
+  if(notes->len > 0)
+    g_signal_emit(self, signals[MESSAGES_RECEIVED], 0, notes);
 
-  g_free(message);
+  g_ptr_array_unref(notes);
 
   return FALSE;
 }
@@ -152,11 +637,27 @@ dbus_spy_init(DBusSpy *self)
 
   self->priv->connection = NULL;
   self->priv->connection_cancel = g_cancellable_new();
-
-  g_bus_get(G_BUS_TYPE_SESSION,
-            self->priv->connection_cancel,
-            bus_get_cb,
-            self);
+  self->priv->filter_id = 0;
+  self->priv->is_monitor = FALSE;
+  self->priv->malformed_count = 0;
+  g_mutex_init(&self->priv->filter_lock);
+  self->priv->filter_set = NULL;
+  g_mutex_init(&self->priv->record_lock);
+  self->priv->recorder = NULL;
+  self->priv->pending_calls = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                     (GDestroyNotify) notification_unref);
+  g_queue_init(&self->priv->pending_order);
+
+  g_mutex_init(&self->priv->queue_lock);
+  self->priv->queue = g_queue_new();
+  self->priv->idle_id = 0;
+  self->priv->queue_limit = DBUS_SPY_DEFAULT_QUEUE_LIMIT;
+  self->priv->overflow_policy = DBUS_SPY_OVERFLOW_DROP_OLDEST;
+  self->priv->dropped_oldest = 0;
+  self->priv->dropped_newest = 0;
+  self->priv->collapsed = 0;
+
+  start_monitor(self);
 }
 
 static void
@@ -171,17 +672,177 @@ dbus_spy_dispose(GObject *object)
   }
 
   if(self->priv->connection != NULL) {
+    if(self->priv->filter_id != 0) {
+      g_dbus_connection_remove_filter(self->priv->connection, self->priv->filter_id);
+      self->priv->filter_id = 0;
+    }
     g_dbus_connection_close(self->priv->connection, NULL, NULL, NULL);
     g_object_unref(self->priv->connection);
     self->priv->connection = NULL;
   }
 
+  g_mutex_lock(&self->priv->queue_lock);
+  if(self->priv->idle_id != 0) {
+    g_source_remove(self->priv->idle_id);
+    self->priv->idle_id = 0;
+  }
+  if(self->priv->queue != NULL) {
+    g_queue_free_full(self->priv->queue, (GDestroyNotify) notification_unref);
+    self->priv->queue = NULL;
+  }
+  g_mutex_unlock(&self->priv->queue_lock);
+
   G_OBJECT_CLASS(dbus_spy_parent_class)->dispose(object);
 }
 
-DBusSpy* 
+static void
+dbus_spy_finalize(GObject *object)
+{
+  DBusSpy *self = DBUS_SPY(object);
+
+  g_mutex_clear(&self->priv->queue_lock);
+  g_mutex_clear(&self->priv->filter_lock);
+  g_mutex_clear(&self->priv->record_lock);
+  g_queue_clear(&self->priv->pending_order);
+  g_hash_table_unref(self->priv->pending_calls);
+
+  if(self->priv->recorder != NULL)
+    notify_recorder_free(self->priv->recorder);
+
+  if(self->priv->filter_set != NULL)
+    g_hash_table_unref(self->priv->filter_set);
+
+  G_OBJECT_CLASS(dbus_spy_parent_class)->finalize(object);
+}
+
+DBusSpy*
 dbus_spy_new(void)
 {
   return DBUS_SPY(g_object_new(DBUS_SPY_TYPE, NULL));
 }
 
+/**
+ * dbus_spy_get_malformed_count:
+ * @self: the dbus spy
+ *
+ * Returns: the number of Notify calls that were discarded because their
+ * body could not be parsed.
+ **/
+guint
+dbus_spy_get_malformed_count(DBusSpy *self)
+{
+  g_return_val_if_fail(IS_DBUS_SPY(self), 0);
+
+  return g_atomic_int_get(&self->priv->malformed_count);
+}
+
+/**
+ * dbus_spy_start_recording:
+ * @self: the dbus spy
+ * @path: the file to write
+ * @error: return location for an error
+ *
+ * Starts writing the body of every Notify call seen, with its timestamp, to
+ * @path. This includes calls that are filtered or discarded later, so the
+ * recording can be replayed to reproduce the full load on the indicator. Any
+ * recording already in progress is stopped first.
+ *
+ * Returns: FALSE if the file could not be created.
+ **/
+gboolean
+dbus_spy_start_recording(DBusSpy *self, const gchar *path, GError **error)
+{
+  g_return_val_if_fail(IS_DBUS_SPY(self), FALSE);
+  g_return_val_if_fail(path != NULL, FALSE);
+
+  NotifyRecorder *recorder = notify_recorder_new(path, error);
+
+  if(recorder == NULL)
+    return FALSE;
+
+  g_mutex_lock(&self->priv->record_lock);
+  if(self->priv->recorder != NULL)
+    notify_recorder_free(self->priv->recorder);
+  g_atomic_pointer_set(&self->priv->recorder, recorder);
+  g_mutex_unlock(&self->priv->record_lock);
+
+  return TRUE;
+}
+
+/**
+ * dbus_spy_set_filter_list:
+ * @self: the dbus spy
+ * @app_names: (nullable): a NULL-terminated array of application names
+ *
+ * Sets the applications whose notifications are discarded. The spy checks
+ * them in the GDBus worker thread, so filtered notifications are never parsed
+ * or passed to the main loop. The set is rebuilt and swapped in whole, it is
+ * never modified while the worker thread can see it.
+ **/
+void
+dbus_spy_set_filter_list(DBusSpy *self, const gchar * const *app_names)
+{
+  g_return_if_fail(IS_DBUS_SPY(self));
+  GHashTable *filter_set = NULL;
+  GHashTable *old_set;
+  guint i;
+
+  if(app_names != NULL && app_names[0] != NULL) {
+    filter_set = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for(i = 0; app_names[i] != NULL; i++)
+      g_hash_table_add(filter_set, g_strdup(app_names[i]));
+  }
+
+  g_mutex_lock(&self->priv->filter_lock);
+  old_set = self->priv->filter_set;
+  self->priv->filter_set = filter_set;
+  g_mutex_unlock(&self->priv->filter_lock);
+
+  if(old_set != NULL)
+    g_hash_table_unref(old_set);
+}
+
+/**
+ * dbus_spy_set_queue_limit:
+ * @self: the dbus spy
+ * @limit: the maximum number of notifications waiting for the main loop
+ * @policy: what to do with new notifications when the queue is full
+ *
+ * Bounds the queue between the GDBus worker thread and the main loop.
+ **/
+void
+dbus_spy_set_queue_limit(DBusSpy *self, guint limit, DBusSpyOverflowPolicy policy)
+{
+  g_return_if_fail(IS_DBUS_SPY(self));
+  g_return_if_fail(limit > 0);
+
+  g_mutex_lock(&self->priv->queue_lock);
+  self->priv->queue_limit = limit;
+  self->priv->overflow_policy = policy;
+  g_mutex_unlock(&self->priv->queue_lock);
+}
+
+/**
+ * dbus_spy_get_overflow_counts:
+ * @self: the dbus spy
+ * @dropped_oldest: (out) (optional): queued notifications dropped for newer ones
+ * @dropped_newest: (out) (optional): new notifications dropped because the queue was full
+ * @collapsed: (out) (optional): queued notifications replaced by a newer one from the same application
+ *
+ * Gets the number of notifications lost to the overflow policy so far.
+ **/
+void
+dbus_spy_get_overflow_counts(DBusSpy *self, guint *dropped_oldest,
+                             guint *dropped_newest, guint *collapsed)
+{
+  g_return_if_fail(IS_DBUS_SPY(self));
+
+  g_mutex_lock(&self->priv->queue_lock);
+  if(dropped_oldest != NULL)
+    *dropped_oldest = self->priv->dropped_oldest;
+  if(dropped_newest != NULL)
+    *dropped_newest = self->priv->dropped_newest;
+  if(collapsed != NULL)
+    *collapsed = self->priv->collapsed;
+  g_mutex_unlock(&self->priv->queue_lock);
+}
@@ -10,6 +10,7 @@
 #include <gio/gio.h>
 
 #include "notification.h"
+#include "notify-recording.h"
 
 G_BEGIN_DECLS
 
@@ -19,6 +20,12 @@ G_BEGIN_DECLS
 #define IS_DBUS_SPY(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), DBUS_SPY_TYPE))
 #define IS_DBUS_SPY_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), DBUS_SPY_TYPE))
 
+typedef enum {
+  DBUS_SPY_OVERFLOW_DROP_OLDEST,
+  DBUS_SPY_OVERFLOW_DROP_NEWEST,
+  DBUS_SPY_OVERFLOW_COLLAPSE_PER_APP
+} DBusSpyOverflowPolicy;
+
 typedef struct _DBusSpy       DBusSpy;
 typedef struct _DBusSpyClass  DBusSpyClass;
 typedef struct _DBusSpyPrivate DBusSpyPrivate;
@@ -33,19 +40,57 @@ struct _DBusSpyClass
 {
   GObjectClass parent_class;
 
-  void (* message_received) (DBusSpy *spy,
-                             Notification *note);
+  void (* messages_received) (DBusSpy *spy,
+                              GPtrArray *notes);
 };
 
 struct _DBusSpyPrivate {
   GDBusConnection *connection;
   GCancellable *connection_cancel;
+  guint filter_id;
+  gboolean is_monitor;
+
+  /* Number of Notify calls rejected by the parser, accessed atomically */
+  gint malformed_count;
+
+  /* Immutable set of application names to discard, swapped under filter_lock */
+  GMutex filter_lock;
+  GHashTable *filter_set;
+
+  /* Writes every Notify body seen when set, protected by record_lock */
+  GMutex record_lock;
+  NotifyRecorder *recorder;
+
+  /* Notify calls waiting for the daemon's reply, keyed by "sender serial",
+   * and their keys oldest first. Only used from the GDBus worker thread. */
+  GHashTable *pending_calls;
+  GQueue pending_order;
+
+  /* Notifications waiting for the main loop, protected by queue_lock */
+  GMutex queue_lock;
+  GQueue *queue;
+  guint idle_id;
+  guint queue_limit;
+  DBusSpyOverflowPolicy overflow_policy;
+
+  /* Overflow counters, protected by queue_lock */
+  guint dropped_oldest;
+  guint dropped_newest;
+  guint collapsed;
 };
 
-#define DBUS_SPY_SIGNAL_MESSAGE_RECEIVED "message-received"
+#define DBUS_SPY_DEFAULT_QUEUE_LIMIT 256
+
+#define DBUS_SPY_SIGNAL_MESSAGES_RECEIVED "messages-received"
 
 GType    dbus_spy_get_type(void);
 DBusSpy* dbus_spy_new(void);
+guint    dbus_spy_get_malformed_count(DBusSpy *self);
+gboolean dbus_spy_start_recording(DBusSpy *self, const gchar *path, GError **error);
+void     dbus_spy_set_filter_list(DBusSpy *self, const gchar * const *app_names);
+void     dbus_spy_set_queue_limit(DBusSpy *self, guint limit, DBusSpyOverflowPolicy policy);
+void     dbus_spy_get_overflow_counts(DBusSpy *self, guint *dropped_oldest,
+                                      guint *dropped_newest, guint *collapsed);
 
 G_END_DECLS
 
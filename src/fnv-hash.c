@@ -0,0 +1,31 @@
+/*
+ * fnv-hash.c - The 32-bit FNV-1a hash.
+ */
+
+#include "fnv-hash.h"
+
+#define FNV_HASH_PRIME 16777619u
+
+/**
+ * fnv_hash_update:
+ * @hash: the hash so far, or FNV_HASH_INIT
+ * @data: the bytes to add
+ * @length: the number of bytes
+ *
+ * Continues a FNV-1a hash over @data.
+ *
+ * Returns: the updated hash.
+ **/
+guint32
+fnv_hash_update(guint32 hash, const void *data, gsize length)
+{
+  const guchar *bytes = data;
+  gsize i;
+
+  for(i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_HASH_PRIME;
+  }
+
+  return hash;
+}
@@ -0,0 +1,19 @@
+/*
+ * fnv-hash.h - The 32-bit FNV-1a hash.
+ */
+
+#ifndef __FNV_HASH_H__
+#define __FNV_HASH_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* The hash of no bytes, to start from */
+#define FNV_HASH_INIT 2166136261u
+
+guint32 fnv_hash_update(guint32 hash, const void *data, gsize length);
+
+G_END_DECLS
+
+#endif /* __FNV_HASH_H__ */
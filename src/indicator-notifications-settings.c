@@ -312,12 +312,11 @@ indicator_notifications_settings_activate(GApplication *app)
   gtk_widget_show(button_swap_clr_s);
 
   /* max-items */
-  /* FIXME: indicator does not change max items until restart... */
   spin_label = gtk_label_new(_("Maximum number of visible notifications"));
   gtk_box_pack_start(GTK_BOX(vbox), spin_label, FALSE, FALSE, 4);
   gtk_widget_show(spin_label);
 
-  spin = gtk_spin_button_new_with_range(1, 10, 1);
+  spin = gtk_spin_button_new_with_range(1, 100, 1);
   gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin), g_settings_get_int(self->settings, NOTIFICATIONS_KEY_MAX_ITEMS));
   g_signal_connect(spin, "value-changed", G_CALLBACK(max_items_changed_cb), self->settings);
   gtk_box_pack_start(GTK_BOX(vbox), spin, FALSE, FALSE, 4);
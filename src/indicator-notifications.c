@@ -32,7 +32,10 @@ with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <libindicator/indicator-service-manager.h>
 
 #include "dbus-spy.h"
+#include "notification-history.h"
 #include "notification-menuitem.h"
+#include "notification-store.h"
+#include "rate-limiter.h"
 
 #define INDICATOR_NOTIFICATIONS_TYPE            (indicator_notifications_get_type ())
 #define INDICATOR_NOTIFICATIONS(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), INDICATOR_NOTIFICATIONS_TYPE, IndicatorNotifications))
@@ -57,18 +60,25 @@ struct _IndicatorNotifications {
 struct _IndicatorNotificationsPrivate {
   GtkImage    *image;
 
-  GList       *visible_items;
-  GList       *hidden_items;
+  /* The notifications, visible or hidden */
+  NotificationStore *store;
+
+  /* The notifications kept across restarts, NULL unless history-persist is set */
+  NotificationHistory *history;
 
   gboolean     clear_on_middle_click;
   gboolean     do_not_disturb;
   gboolean     have_unread;
   gboolean     hide_indicator;
   gboolean     swap_clear_settings;
+  gboolean     group_by_app;
 
   gint         max_items;
+  gint         history_size;
 
   GtkMenu     *menu;
+  GtkWidget   *search_item;
+  GtkWidget   *search_entry;
   GtkWidget   *clear_item;
   GtkWidget   *clear_item_label;
   GtkWidget   *settings_item;
@@ -77,10 +87,39 @@ struct _IndicatorNotificationsPrivate {
 
   DBusSpy     *spy;
 
-  GHashTable  *filter_list;
+  /* The notifications the spy had lost when that was last logged */
+  guint        lost_reported;
+  gint64       lost_reported_at;
 
   GList       *filter_list_hints;
 
+  RateLimiter *rate_limiter;
+  GHashTable  *suppressed_items;
+
+  /* Seconds within which a repeated notification only bumps its counter */
+  gint         dedup_window;
+
+  /* The notification menuitems put in the menu by the last update_search()
+   * or show_menuitems() */
+  guint        search_shown;
+
+  /* In grouped mode, the AppGroup of each application by interned name,
+   * and the groups with the newest notification first */
+  GHashTable  *groups;
+  GQueue       group_order;
+  guint        release_menuitems_id;
+
+  /* The menuitems built for visible notifications while the menu is open,
+   * by store item. Nothing else keeps a widget for a notification. */
+  GHashTable  *menuitems;
+
+  /* Detached notification menuitems waiting to be reused by new_menuitem() */
+  GPtrArray   *menuitem_pool;
+
+  /* The pending update_menu(), on the menu's frame clock while it is mapped */
+  guint        menu_update_tick_id;
+  guint        menu_update_idle_id;
+
   GSettings   *settings;
 };
 
@@ -94,6 +133,61 @@ struct _IndicatorNotificationsPrivate {
 
 #define HINT_MAX 10
 
+typedef struct _SuppressedItem SuppressedItem;
+struct _SuppressedItem
+{
+  GtkWidget *item;
+  guint      count;
+};
+
+/* In grouped mode, one menuitem stands for all notifications from an
+ * application. Its submenu is only filled while it is open, so the number of
+ * notification menuitems is bounded by the number of applications. The store
+ * then holds the notifications themselves as items instead of menuitems. */
+typedef struct _AppGroup AppGroup;
+struct _AppGroup
+{
+  IndicatorNotifications *self;
+
+  /* The link in group_order, its data is the group */
+  GList         link;
+
+  const gchar  *app_name;
+  Notification *latest;
+
+  /* Set when latest has to be looked up again */
+  gboolean      dirty;
+
+  GtkWidget    *item;
+  GtkWidget    *label;
+  GtkWidget    *submenu;
+};
+
+/* Keys for the object data of menuitems */
+#define GROUP_KEY "notification-group"
+#define ITEM_KEY  "notification-store-item"
+
+/* Notifications beyond this are left out of an application's submenu */
+#define GROUP_ITEMS_MAX 50
+
+/* Detached notification menuitems kept for reuse */
+#define MENUITEM_POOL_MAX 32
+
+/* The notification menuitems follow the search menuitem */
+#define NOTIFICATIONS_POSITION 1
+
+/* Search results beyond this are not shown */
+#define SEARCH_RESULTS_MAX 50
+
+/* The history is kept in this directory under the user's cache directory */
+#define HISTORY_DIR "indicator-notifications"
+
+/* Notifications lost by the spy are logged at most this often */
+#define LOST_REPORT_INTERVAL (60 * G_USEC_PER_SEC)
+
+/* Environment variable naming a file to record the Notify calls to, see notify-replay */
+#define RECORD_ENV "INDICATOR_NOTIFICATIONS_RECORD"
+
 GType indicator_notifications_get_type(void);
 
 /* Indicator Class Functions */
@@ -113,16 +207,54 @@ static void         indicator_notifications_middle_click(IndicatorObject *io,
 
 /* Utility Functions */
 static void clear_menuitems(IndicatorNotifications *self);
-static void insert_menuitem(IndicatorNotifications *self, GtkWidget *item);
-static void remove_menuitem(IndicatorNotifications *self, GtkWidget *item);
+static void insert_notification(IndicatorNotifications *self, Notification *note);
+static void remove_menuitem(IndicatorNotifications *self, GtkWidget *widget);
+static void show_menuitems(IndicatorNotifications *self);
+static void place_menuitem(gpointer item, gpointer user_data);
+static void clear_menuitem_table(IndicatorNotifications *self);
+static void queue_menu_update(IndicatorNotifications *self);
+static void update_menu(IndicatorNotifications *self);
+static gboolean menu_update_tick_cb(GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data);
+static gboolean menu_update_idle_cb(gpointer user_data);
+static void recycle_menuitem(IndicatorNotifications *self, GtkWidget *widget);
+static void remove_notifications_from_menu(IndicatorNotifications *self);
+static gboolean is_searching(IndicatorNotifications *self);
+static void update_search(IndicatorNotifications *self);
+static void append_menuitem(gpointer item, gpointer user_data);
+static guint get_shown_length(IndicatorNotifications *self);
+static GtkWidget *item_menuitem(IndicatorNotifications *self, gpointer item);
+static void update_group_by_app(IndicatorNotifications *self);
+static void update_max_items(IndicatorNotifications *self);
+static void move_menuitem(gpointer item, gpointer user_data);
+static void group_notification(gpointer data, gpointer user_data);
+static void touch_group(IndicatorNotifications *self, const gchar *app_name, gboolean raise);
+static void update_groups(IndicatorNotifications *self);
+static void remove_group(IndicatorNotifications *self, AppGroup *group);
+static void clear_groups(IndicatorNotifications *self);
+static void group_free(gpointer data);
+static void release_submenu(AppGroup *group);
+static void update_submenu_menuitem(AppGroup *group, gpointer item, Notification *note);
+static void find_latest(gpointer item, gpointer user_data);
+static void append_to_submenu(gpointer item, gpointer user_data);
 static void set_unread(IndicatorNotifications *self, gboolean unread);
 static void update_unread(IndicatorNotifications *self);
 static void update_filter_list(IndicatorNotifications *self);
+static void update_queue_limit(IndicatorNotifications *self);
+static void update_rate_limit(IndicatorNotifications *self);
+static void update_history(IndicatorNotifications *self);
+static void open_history(IndicatorNotifications *self, gboolean restore);
+static void sync_history(IndicatorNotifications *self);
+static void report_lost_notifications(IndicatorNotifications *self);
+static void collect_notification(gpointer note, gpointer user_data);
+static GtkWidget *new_menuitem(IndicatorNotifications *self, Notification *note);
+static void add_suppressed(IndicatorNotifications *self, const gchar *app_name);
+static void clear_suppressed(IndicatorNotifications *self);
+static void suppressed_item_free(gpointer data);
 static void update_clear_item_markup(IndicatorNotifications *self);
 static void update_indicator_visibility(IndicatorNotifications *self);
 static void load_filter_list_hints(IndicatorNotifications *self);
 static void save_filter_list_hints(IndicatorNotifications *self);
-static void update_filter_list_hints(IndicatorNotifications *self, Notification *notification);
+static gboolean update_filter_list_hints(IndicatorNotifications *self, Notification *notification);
 static void update_do_not_disturb(IndicatorNotifications *self);
 static void settings_try_set_boolean(const gchar *schema, const gchar *key, gboolean value);
 static void swap_clear_settings_items(IndicatorNotifications *self);
@@ -130,10 +262,19 @@ static void swap_clear_settings_items(IndicatorNotifications *self);
 /* Callbacks */
 static void clear_item_activated_cb(GtkMenuItem *menuitem, gpointer user_data);
 static void menu_visible_notify_cb(GtkWidget *menu, GParamSpec *pspec, gpointer user_data);
-static void message_received_cb(DBusSpy *spy, Notification *note, gpointer user_data);
+static gboolean menu_key_press_cb(GtkWidget *menu, GdkEventKey *event, gpointer user_data);
+static gboolean search_item_button_release_cb(GtkWidget *widget, GdkEventButton *event, gpointer user_data);
+static void search_changed_cb(GtkEditable *editable, gpointer user_data);
+static void group_item_select_cb(GtkMenuItem *menuitem, gpointer user_data);
+static gboolean release_menuitems_cb(gpointer user_data);
+static gboolean add_notification(IndicatorNotifications *self, Notification *note, gboolean *hints_changed);
+static void replace_notification(IndicatorNotifications *self, gpointer item, Notification *note);
+static void messages_received_cb(DBusSpy *spy, GPtrArray *notes, gpointer user_data);
 static void notification_clicked_cb(NotificationMenuItem *menuitem, guint button, gpointer user_data);
 static void setting_changed_cb(GSettings *settings, gchar *key, gpointer user_data);
 static void settings_item_activated_cb(GtkMenuItem *menuitem, gpointer user_data);
+static void suppressed_item_activated_cb(GtkMenuItem *menuitem, gpointer user_data);
+static gboolean suppressed_item_find(gpointer key, gpointer value, gpointer user_data);
 
 /* Indicator Module Config */
 INDICATOR_SET_VERSION
@@ -172,11 +313,15 @@ indicator_notifications_init(IndicatorNotifications *self)
 
   self->priv->accessible_desc = _("Notifications");
 
-  self->priv->visible_items = NULL;
-  self->priv->hidden_items = NULL;
+  self->priv->store = NULL;
+  self->priv->history = NULL;
+
+  self->priv->groups = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, group_free);
+  g_queue_init(&self->priv->group_order);
 
   self->priv->menu = GTK_MENU(gtk_menu_new());
   g_signal_connect(self->priv->menu, "notify::visible", G_CALLBACK(menu_visible_notify_cb), self);
+  g_signal_connect(self->priv->menu, "key-press-event", G_CALLBACK(menu_key_press_cb), self);
 
   /* Create the settings menuitem */
   self->priv->settings_item = gtk_menu_item_new_with_label(_("Settings…"));
@@ -190,7 +335,6 @@ indicator_notifications_init(IndicatorNotifications *self)
   gtk_label_set_xalign(GTK_LABEL(self->priv->clear_item_label), 0);
   gtk_label_set_yalign(GTK_LABEL(self->priv->clear_item_label), 0);
   gtk_label_set_use_markup(GTK_LABEL(self->priv->clear_item_label), TRUE);
-  update_clear_item_markup(self);
   gtk_widget_show(self->priv->clear_item_label);
 
   self->priv->clear_item = gtk_menu_item_new();
@@ -200,12 +344,36 @@ indicator_notifications_init(IndicatorNotifications *self)
 
   gtk_menu_shell_prepend(GTK_MENU_SHELL(self->priv->menu), self->priv->clear_item);
 
+  /* Create the search menuitem, typing while the menu is open goes to its entry */
+  self->priv->search_entry = gtk_search_entry_new();
+  gtk_entry_set_placeholder_text(GTK_ENTRY(self->priv->search_entry), _("Type to search…"));
+  gtk_widget_set_can_focus(self->priv->search_entry, FALSE);
+  g_signal_connect(self->priv->search_entry, "changed", G_CALLBACK(search_changed_cb), self);
+  gtk_widget_show(self->priv->search_entry);
+
+  self->priv->search_item = gtk_menu_item_new();
+  g_signal_connect(self->priv->search_item, "button-release-event", G_CALLBACK(search_item_button_release_cb), NULL);
+  gtk_container_add(GTK_CONTAINER(self->priv->search_item), self->priv->search_entry);
+
+  gtk_menu_shell_prepend(GTK_MENU_SHELL(self->priv->menu), self->priv->search_item);
+
   /* Watch for notifications from dbus */
   self->priv->spy = dbus_spy_new();
-  g_signal_connect(self->priv->spy, DBUS_SPY_SIGNAL_MESSAGE_RECEIVED, G_CALLBACK(message_received_cb), self);
+  g_signal_connect(self->priv->spy, DBUS_SPY_SIGNAL_MESSAGES_RECEIVED, G_CALLBACK(messages_received_cb), self);
+
+  /* Record the Notify calls for replaying them later, if asked to */
+  const gchar *record_path = g_getenv(RECORD_ENV);
+  if(record_path != NULL && record_path[0] != '\0') {
+    GError *error = NULL;
 
-  /* Initialize an empty filter list */
-  self->priv->filter_list = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    if(!dbus_spy_start_recording(self->priv->spy, record_path, &error)) {
+      g_warning("Failed to start recording notifications: %s", error->message);
+      g_error_free(error);
+    }
+  }
+
+  /* Counters for notifications over the rate limit, by application name */
+  self->priv->suppressed_items = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, suppressed_item_free);
 
   /* Connect to GSettings */
   self->priv->settings = g_settings_new(NOTIFICATIONS_SCHEMA);
@@ -213,9 +381,29 @@ indicator_notifications_init(IndicatorNotifications *self)
   self->priv->do_not_disturb = g_settings_get_boolean(self->priv->settings, NOTIFICATIONS_KEY_DND);
   self->priv->hide_indicator = g_settings_get_boolean(self->priv->settings, NOTIFICATIONS_KEY_HIDE_INDICATOR);
   self->priv->max_items = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_MAX_ITEMS);
+  self->priv->history_size = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_HISTORY_SIZE);
   self->priv->swap_clear_settings = g_settings_get_boolean(self->priv->settings, NOTIFICATIONS_KEY_SWAP_CLEAR_SETTINGS);
+  self->priv->group_by_app = g_settings_get_boolean(self->priv->settings, NOTIFICATIONS_KEY_GROUP_BY_APP);
+
+  /* The store holds a ref to each notification as its item */
+  self->priv->store = notification_store_new(self->priv->max_items, self->priv->history_size,
+                                             (GDestroyNotify) notification_unref);
+  self->priv->menuitems = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                (GDestroyNotify) notification_unref, NULL);
+  self->priv->menuitem_pool = g_ptr_array_new();
+
+  /* Show the notifications from the last session */
+  if(g_settings_get_boolean(self->priv->settings, NOTIFICATIONS_KEY_HISTORY_PERSIST))
+    open_history(self, TRUE);
+
+  update_clear_item_markup(self);
+
+  self->priv->rate_limiter = rate_limiter_new(0, 1);
+  self->priv->dedup_window = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_DEDUP_WINDOW);
 
   update_filter_list(self);
+  update_queue_limit(self);
+  update_rate_limit(self);
 
   if(self->priv->swap_clear_settings)
     swap_clear_settings_items(self);
@@ -237,14 +425,54 @@ indicator_notifications_dispose(GObject *object)
     self->priv->image = NULL;
   }
 
-  if(self->priv->visible_items != NULL) {
-    g_list_free_full(self->priv->visible_items, g_object_unref);
-    self->priv->visible_items = NULL;
+  if(self->priv->history != NULL) {
+    notification_history_free(self->priv->history);
+    self->priv->history = NULL;
+  }
+
+  if(self->priv->store != NULL) {
+    notification_store_free(self->priv->store);
+    self->priv->store = NULL;
+  }
+
+  if(self->priv->release_menuitems_id != 0) {
+    g_source_remove(self->priv->release_menuitems_id);
+    self->priv->release_menuitems_id = 0;
+  }
+
+  if(self->priv->menu_update_idle_id != 0) {
+    g_source_remove(self->priv->menu_update_idle_id);
+    self->priv->menu_update_idle_id = 0;
+  }
+
+  if(self->priv->menu_update_tick_id != 0) {
+    gtk_widget_remove_tick_callback(GTK_WIDGET(self->priv->menu), self->priv->menu_update_tick_id);
+    self->priv->menu_update_tick_id = 0;
   }
 
-  if(self->priv->hidden_items != NULL) {
-    g_list_free_full(self->priv->hidden_items, g_object_unref);
-    self->priv->hidden_items = NULL;
+  if(self->priv->menuitems != NULL) {
+    clear_menuitem_table(self);
+    g_hash_table_unref(self->priv->menuitems);
+    self->priv->menuitems = NULL;
+  }
+
+  if(self->priv->menuitem_pool != NULL) {
+    g_ptr_array_foreach(self->priv->menuitem_pool, (GFunc) gtk_widget_destroy, NULL);
+    g_ptr_array_foreach(self->priv->menuitem_pool, (GFunc) g_object_unref, NULL);
+    g_ptr_array_unref(self->priv->menuitem_pool);
+    self->priv->menuitem_pool = NULL;
+  }
+
+  /* The groups remove themselves from the menu */
+  if(self->priv->groups != NULL) {
+    g_hash_table_unref(self->priv->groups);
+    self->priv->groups = NULL;
+  }
+
+  /* The suppressed items remove themselves from the menu */
+  if(self->priv->suppressed_items != NULL) {
+    g_hash_table_unref(self->priv->suppressed_items);
+    self->priv->suppressed_items = NULL;
   }
 
   if(self->priv->menu != NULL) {
@@ -262,16 +490,16 @@ indicator_notifications_dispose(GObject *object)
     self->priv->settings = NULL;
   }
 
-  if(self->priv->filter_list != NULL) {
-    g_hash_table_unref(self->priv->filter_list);
-    self->priv->filter_list = NULL;
-  }
-
   if(self->priv->filter_list_hints != NULL) {
     g_list_free_full(self->priv->filter_list_hints, g_free);
     self->priv->filter_list_hints = NULL;
   }
 
+  if(self->priv->rate_limiter != NULL) {
+    rate_limiter_free(self->priv->rate_limiter);
+    self->priv->rate_limiter = NULL;
+  }
+
   G_OBJECT_CLASS (indicator_notifications_parent_class)->dispose (object);
   return;
 }
@@ -327,7 +555,7 @@ indicator_notifications_middle_click(IndicatorObject *io, IndicatorObjectEntry *
   }
   /* Otherwise toggle unread status */
   else {
-    if(g_list_length(self->priv->visible_items) > 0)
+    if(notification_store_get_length(self->priv->store) > 0)
       set_unread(self, !self->priv->have_unread);
   }
 }
@@ -336,342 +564,1229 @@ indicator_notifications_middle_click(IndicatorObject *io, IndicatorObjectEntry *
  * clear_menuitems:
  * @self: the indicator
  *
- * Clear all notification menuitems from the menu and the visible/hidden lists.
+ * Clear all notification menuitems from the menu and the store.
  **/
 static void
 clear_menuitems(IndicatorNotifications *self)
 {
   g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
-  GList *item;
 
-  /* Remove each visible item from the menu */
-  for(item = self->priv->visible_items; item; item = item->next) {
-    gtk_container_remove(GTK_CONTAINER(self->priv->menu), GTK_WIDGET(item->data));
-  }
+  remove_notifications_from_menu(self);
+  clear_menuitem_table(self);
+
+  notification_store_clear(self->priv->store);
+  clear_groups(self);
 
-  /* Clear the lists */
-  g_list_free_full(self->priv->visible_items, g_object_unref);
-  self->priv->visible_items = NULL;
+  /* Nothing is left to search */
+  gtk_entry_set_text(GTK_ENTRY(self->priv->search_entry), "");
 
-  g_list_free_full(self->priv->hidden_items, g_object_unref);
-  self->priv->hidden_items = NULL;
+  if(self->priv->history != NULL)
+    notification_history_clear(self->priv->history);
+
+  clear_suppressed(self);
 
   update_clear_item_markup(self);
+  sync_history(self);
 }
 
 /**
- * insert_menuitem:
+ * insert_notification:
  * @self: the indicator
- * @item: the menuitem to insert
+ * @note: the notification
  *
- * Inserts a menuitem into the indicator's menu and updates the visible and
- * hidden lists.
+ * Inserts a notification into the store, raising the group of its application
+ * in grouped mode. The rest of the menu is updated once for the whole batch
+ * of notifications, and a menuitem is only built while the menu is open.
  **/
 static void
-insert_menuitem(IndicatorNotifications *self, GtkWidget *item)
+insert_notification(IndicatorNotifications *self, Notification *note)
 {
   g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
-  g_return_if_fail(GTK_IS_MENU_ITEM(item));
-  GList     *last_item;
-  GtkWidget *last_widget;
-
-  /* List holds a ref to the menuitem */
-  self->priv->visible_items = g_list_prepend(self->priv->visible_items, g_object_ref(item));
-  gtk_menu_shell_prepend(GTK_MENU_SHELL(self->priv->menu), item);
-
-  /* Move items that overflow to the hidden list */
-  while(g_list_length(self->priv->visible_items) > self->priv->max_items) {
-    last_item = g_list_last(self->priv->visible_items);  
-    last_widget = GTK_WIDGET(last_item->data);
-    /* Steal the ref from the visible list */
-    self->priv->visible_items = g_list_delete_link(self->priv->visible_items, last_item);
-    self->priv->hidden_items = g_list_prepend(self->priv->hidden_items, last_widget);
-    gtk_container_remove(GTK_CONTAINER(self->priv->menu), last_widget);
-    last_item = NULL;
-    last_widget = NULL;
-  }
 
-  update_clear_item_markup(self);
+  notification_store_push(self->priv->store, note, notification_ref(note));
+
+  if(self->priv->group_by_app)
+    touch_group(self, notification_get_app_name(note), TRUE);
+
+  queue_menu_update(self);
 }
 
 /**
- * remove_menuitem:
+ * queue_menu_update:
  * @self: the indicator object
- * @item: the menuitem
  *
- * Removes a menuitem from the indicator menu and the visible list.
+ * Schedules update_menu() for the next frame of the open menu, or for when
+ * the main loop is idle while it is closed, so that a burst of notifications
+ * changes the menu only once.
  **/
 static void
-remove_menuitem(IndicatorNotifications *self, GtkWidget *item)
+queue_menu_update(IndicatorNotifications *self)
 {
   g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
-  g_return_if_fail(GTK_IS_MENU_ITEM(item));
 
-  GList *list_item = g_list_find(self->priv->visible_items, item);
-
-  if(list_item == NULL) {
-    g_warning("Attempt to remove menuitem not in visible list");
+  if(self->priv->menu_update_tick_id != 0 || self->priv->menu_update_idle_id != 0)
     return;
+
+  if(gtk_widget_get_mapped(GTK_WIDGET(self->priv->menu))) {
+    self->priv->menu_update_tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(self->priv->menu),
+                                                                   menu_update_tick_cb, self, NULL);
   }
+  else {
+    self->priv->menu_update_idle_id = g_idle_add(menu_update_idle_cb, self);
+  }
+}
+
+/**
+ * update_menu:
+ * @self: the indicator object
+ *
+ * Brings the notification menuitems or search results, the groups and the
+ * clear item up to date with the store, cancelling any pending update.
+ **/
+static void
+update_menu(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
 
-  /* Remove the item */
-  gtk_container_remove(GTK_CONTAINER(self->priv->menu), item);
-  self->priv->visible_items = g_list_delete_link(self->priv->visible_items, list_item);
-  g_object_unref(item);
+  if(self->priv->menu_update_idle_id != 0) {
+    g_source_remove(self->priv->menu_update_idle_id);
+    self->priv->menu_update_idle_id = 0;
+  }
 
-  /* Add an item from the hidden list, if available */
-  if(g_list_length(self->priv->hidden_items) > 0) {
-    list_item = g_list_first(self->priv->hidden_items);
-    GtkWidget *list_widget = GTK_WIDGET(list_item->data);
-    self->priv->hidden_items = g_list_delete_link(self->priv->hidden_items, list_item);
-    gtk_menu_shell_insert(GTK_MENU_SHELL(self->priv->menu), list_widget,
-        g_list_length(self->priv->visible_items));
-    /* Steal the ref back from the hidden list */
-    self->priv->visible_items = g_list_append(self->priv->visible_items, list_widget);
+  if(self->priv->menu_update_tick_id != 0) {
+    gtk_widget_remove_tick_callback(GTK_WIDGET(self->priv->menu), self->priv->menu_update_tick_id);
+    self->priv->menu_update_tick_id = 0;
   }
 
+  if(is_searching(self))
+    update_search(self);
+  else if(!self->priv->group_by_app)
+    show_menuitems(self);
+
+  update_groups(self);
   update_clear_item_markup(self);
 }
 
 /**
- * set_unread:
- * @self: the indicator object
- * @unread: the unread status
+ * menu_update_tick_cb:
+ * @widget: the menu
+ * @frame_clock: unused
+ * @user_data: the indicator object
  *
- * Sets the unread status of the indicator and updates the icons.
+ * Runs the pending update_menu() before the open menu draws its next frame.
  **/
-static void
-set_unread(IndicatorNotifications *self, gboolean unread)
+static gboolean
+menu_update_tick_cb(G_GNUC_UNUSED GtkWidget *widget, G_GNUC_UNUSED GdkFrameClock *frame_clock,
+                    gpointer user_data)
 {
-  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
 
-  self->priv->have_unread = unread;
-  update_unread(self);
+  self->priv->menu_update_tick_id = 0;
+  update_menu(self);
+
+  return G_SOURCE_REMOVE;
 }
 
 /**
- * update_unread:
+ * menu_update_idle_cb:
+ * @user_data: the indicator object
+ *
+ * Runs the pending update_menu() while the menu is closed.
+ **/
+static gboolean
+menu_update_idle_cb(gpointer user_data)
+{
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
+
+  self->priv->menu_update_idle_id = 0;
+  update_menu(self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * remove_menuitem:
  * @self: the indicator object
+ * @widget: a notification menuitem made by item_menuitem()
  *
- * Updates the indicator icons.
+ * Removes a notification menuitem from the menu and its notification from
+ * the store, showing the newest hidden notification in its place. While
+ * searching, any search result can be removed.
  **/
 static void
-update_unread(IndicatorNotifications *self)
+remove_menuitem(IndicatorNotifications *self, GtkWidget *widget)
 {
   g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  g_return_if_fail(GTK_IS_MENU_ITEM(widget));
+  gpointer item = g_object_get_data(G_OBJECT(widget), ITEM_KEY);
+  Notification *note = notification_store_get_notification(self->priv->store, item);
 
-  if(self->priv->have_unread) {
-    if (self->priv->do_not_disturb) {
-      gtk_image_set_from_icon_name(self->priv->image, INDICATOR_ICON_UNREAD_DND, GTK_ICON_SIZE_MENU);
-    }
-    else {
-      gtk_image_set_from_icon_name(self->priv->image, INDICATOR_ICON_UNREAD, GTK_ICON_SIZE_MENU);
-    }
+  if(note == NULL) {
+    g_warning("Attempt to remove a notification not in the store");
+    return;
   }
-  else {
-    if (self->priv->do_not_disturb) {
-      gtk_image_set_from_icon_name(self->priv->image, INDICATOR_ICON_READ_DND, GTK_ICON_SIZE_MENU);
-    }
-    else {
-      gtk_image_set_from_icon_name(self->priv->image, INDICATOR_ICON_READ, GTK_ICON_SIZE_MENU);
-    }
+
+  if(self->priv->history != NULL)
+    notification_history_remove(self->priv->history, note);
+
+  if(self->priv->group_by_app)
+    touch_group(self, notification_get_app_name(note), FALSE);
+
+  recycle_menuitem(self, widget);
+
+  /* Search results and submenu menuitems aren't in the table */
+  if(g_hash_table_lookup(self->priv->menuitems, item) == widget) {
+    g_hash_table_remove(self->priv->menuitems, item);
+    g_object_unref(widget);
   }
+
+  notification_store_remove(self->priv->store, item);
+
+  if(is_searching(self))
+    update_search(self);
+  else if(!self->priv->group_by_app)
+    show_menuitems(self);
+
+  update_groups(self);
+  update_clear_item_markup(self);
+  sync_history(self);
 }
 
 /**
- * update_filter_list:
+ * show_menuitems:
  * @self: the indicator object
  *
- * Updates the filter list from GSettings. This currently does not filter already
- * allowed messages. It only applies to messages received in the future.
+ * Puts the menuitems of the visible notifications in the menu while it is
+ * open, building only those that are missing. The menuitems of notifications
+ * no longer visible are recycled.
  **/
 static void
-update_filter_list(IndicatorNotifications *self)
+show_menuitems(IndicatorNotifications *self)
 {
   g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
-  g_return_if_fail(self->priv->filter_list != NULL);
+  GHashTableIter iter;
+  gpointer item;
+  gpointer widget;
 
-  g_hash_table_remove_all(self->priv->filter_list);
-  gchar **items = g_settings_get_strv(self->priv->settings, NOTIFICATIONS_KEY_FILTER_LIST);
-  int i;
+  if(!gtk_widget_get_visible(GTK_WIDGET(self->priv->menu)))
+    return;
 
-  for(i = 0; items[i] != NULL; i++) {
-    g_hash_table_insert(self->priv->filter_list, g_strdup(items[i]), NULL);
+  g_hash_table_iter_init(&iter, self->priv->menuitems);
+  while(g_hash_table_iter_next(&iter, &item, &widget)) {
+    if(!notification_store_is_visible(self->priv->store, item)) {
+      recycle_menuitem(self, widget);
+      g_hash_table_iter_remove(&iter);
+      g_object_unref(widget);
+    }
   }
 
-  g_strfreev(items);
+  self->priv->search_shown = 0;
+  notification_store_foreach_visible(self->priv->store, place_menuitem, self);
 }
 
 /**
- * update_clear_item_markup:
- * @self: the indicator object
+ * place_menuitem:
+ * @item: the item of a visible notification
+ * @user_data: the indicator object
  *
- * Updates the clear menuitem's label markup based on the number of
- * notifications available.
+ * A GFunc moving the menuitem of an item after the ones placed before it,
+ * building the menuitem if there is none yet.
  **/
 static void
-update_clear_item_markup(IndicatorNotifications *self)
+place_menuitem(gpointer item, gpointer user_data)
 {
-  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
-  guint visible_length = g_list_length(self->priv->visible_items);
-  guint hidden_length = g_list_length(self->priv->hidden_items);
-  guint total_length = visible_length + hidden_length;
-
-  gchar *markup = g_strdup_printf(ngettext(
-        "Clear <small>(%d Notification)</small>",
-        "Clear <small>(%d Notifications)</small>",
-        total_length),
-      total_length);
-
-  gtk_label_set_markup(GTK_LABEL(self->priv->clear_item_label), markup);
-  g_free(markup);
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
+  GtkWidget *widget = g_hash_table_lookup(self->priv->menuitems, item);
+  gint position = NOTIFICATIONS_POSITION + self->priv->search_shown++;
 
-  if (total_length == 0) {
-    gtk_menu_shell_deactivate(GTK_MENU_SHELL(self->priv->menu));
+  if(widget == NULL) {
+    widget = item_menuitem(self, item);
+    g_hash_table_insert(self->priv->menuitems, notification_ref(item), widget);
   }
+
+  if(gtk_widget_get_parent(widget) == NULL)
+    gtk_menu_shell_insert(GTK_MENU_SHELL(self->priv->menu), widget, position);
+  else
+    gtk_menu_reorder_child(self->priv->menu, widget, position);
 }
 
 /**
- * update_indicator_visibility:
+ * clear_menuitem_table:
  * @self: the indicator object
  *
- * Changes the visibility of the indicator image based on the value
- * of hide_indicator.
+ * Recycles every menuitem in the menuitems table and empties it.
  **/
 static void
-update_indicator_visibility(IndicatorNotifications *self)
+clear_menuitem_table(IndicatorNotifications *self)
 {
-  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
-  
-  if(self->priv->image != NULL) {
-    if(self->priv->hide_indicator)
-      gtk_widget_hide(GTK_WIDGET(self->priv->image));
-    else
-      gtk_widget_show(GTK_WIDGET(self->priv->image));
+  GHashTableIter iter;
+  gpointer widget;
+
+  g_hash_table_iter_init(&iter, self->priv->menuitems);
+  while(g_hash_table_iter_next(&iter, NULL, &widget)) {
+    recycle_menuitem(self, widget);
+    g_hash_table_iter_remove(&iter);
+    g_object_unref(widget);
   }
 }
 
 /**
- * load_filter_list_hints:
+ * recycle_menuitem:
  * @self: the indicator object
+ * @widget: a notification menuitem made by new_menuitem()
  *
- * Loads the filter list hints from gsettings
+ * Detaches a notification menuitem from its menu and keeps it for
+ * new_menuitem() to reuse, or destroys it once enough are kept. Any other
+ * ref the caller holds still has to be dropped.
  **/
 static void
-load_filter_list_hints(IndicatorNotifications *self)
+recycle_menuitem(IndicatorNotifications *self, GtkWidget *widget)
 {
-  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
-  g_return_if_fail(self->priv->filter_list_hints == NULL);
-
-  gchar **items = g_settings_get_strv(self->priv->settings, NOTIFICATIONS_KEY_FILTER_LIST_HINTS);
-  int i;
+  GtkWidget *parent;
 
-  for (i = 0; items[i] != NULL; i++) {
-    self->priv->filter_list_hints = g_list_prepend(self->priv->filter_list_hints, items[i]);
+  if(self->priv->menuitem_pool == NULL || self->priv->menuitem_pool->len >= MENUITEM_POOL_MAX) {
+    gtk_widget_destroy(widget);
+    return;
   }
 
-  g_free(items);
+  g_ptr_array_add(self->priv->menuitem_pool, g_object_ref(widget));
+
+  parent = gtk_widget_get_parent(widget);
+  if(parent != NULL)
+    gtk_container_remove(GTK_CONTAINER(parent), widget);
+
+  g_object_set_data(G_OBJECT(widget), ITEM_KEY, NULL);
+  notification_menuitem_reset(NOTIFICATION_MENUITEM(widget));
 }
 
 /**
- * save_filter_list_hints:
+ * remove_notifications_from_menu:
  * @self: the indicator object
  *
- * Saves the filter list hints to gsettings
+ * Removes every notification and group menuitem from the menu, leaving them
+ * in the store.
  **/
 static void
-save_filter_list_hints(IndicatorNotifications *self)
+remove_notifications_from_menu(IndicatorNotifications *self)
 {
   g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  GList *children = gtk_container_get_children(GTK_CONTAINER(self->priv->menu));
+  GList *l;
 
-  gchar *hints[HINT_MAX + 1];
-  int i = 0;
+  for(l = children; l != NULL; l = l->next) {
+    GtkWidget *widget = GTK_WIDGET(l->data);
+    gpointer item = g_object_get_data(G_OBJECT(widget), ITEM_KEY);
 
-  GList *l;
-  for (l = self->priv->filter_list_hints; (l != NULL) && (i < HINT_MAX); l = l->next, i++) {
-    hints[i] = (gchar *) l->data;
+    /* Search results are only in the menu, the others are kept */
+    if(IS_NOTIFICATION_MENUITEM(widget) && g_hash_table_lookup(self->priv->menuitems, item) != widget)
+      recycle_menuitem(self, widget);
+    else if(IS_NOTIFICATION_MENUITEM(widget) || g_object_get_data(G_OBJECT(widget), GROUP_KEY) != NULL)
+      gtk_container_remove(GTK_CONTAINER(self->priv->menu), widget);
   }
 
-  hints[i] = NULL;
+  g_list_free(children);
+}
 
-  g_settings_set_strv(self->priv->settings, NOTIFICATIONS_KEY_FILTER_LIST_HINTS, (const gchar **) hints);
+/**
+ * is_searching:
+ * @self: the indicator object
+ *
+ * Returns: TRUE if the menu shows search results instead of the visible notifications.
+ **/
+static gboolean
+is_searching(IndicatorNotifications *self)
+{
+  return gtk_entry_get_text_length(GTK_ENTRY(self->priv->search_entry)) > 0;
 }
 
 /**
- * update_filter_list_hints:
+ * update_search:
  * @self: the indicator object
  *
- * Adds an application name to the hints
+ * Shows the newest notifications matching the search query, visible or
+ * hidden, in place of the visible ones or the groups. Shows those again once
+ * the query is empty.
  **/
 static void
-update_filter_list_hints(IndicatorNotifications *self, Notification *notification)
+update_search(IndicatorNotifications *self)
 {
   g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
-  g_return_if_fail(IS_NOTIFICATION(notification));
 
-  const gchar *appname = notification_get_app_name(notification);
+  remove_notifications_from_menu(self);
+  self->priv->search_shown = 0;
 
-  /* Avoid duplicates */
-  GList *l;
-  for (l = self->priv->filter_list_hints; l != NULL; l = l->next) {
-    if (g_strcmp0(appname, (const gchar *) l->data) == 0)
-      return;
+  if(is_searching(self)) {
+    notification_store_search(self->priv->store, gtk_entry_get_text(GTK_ENTRY(self->priv->search_entry)),
+                              SEARCH_RESULTS_MAX, append_menuitem, self);
   }
+  else if(self->priv->group_by_app) {
+    GList *link;
 
-  /* Add the appname */
-  self->priv->filter_list_hints = g_list_prepend(self->priv->filter_list_hints, g_strdup(appname));
-
-  /* Keep only a reasonable number */
-  while (g_list_length(self->priv->filter_list_hints) > HINT_MAX) {
-    GList *last = g_list_last(self->priv->filter_list_hints);
-    g_free(last->data);
-    self->priv->filter_list_hints = g_list_delete_link(self->priv->filter_list_hints, last);
+    for(link = self->priv->group_order.head; link != NULL; link = link->next) {
+      gtk_menu_shell_insert(GTK_MENU_SHELL(self->priv->menu), ((AppGroup *) link->data)->item,
+                            NOTIFICATIONS_POSITION + self->priv->search_shown);
+      self->priv->search_shown++;
+    }
+  }
+  else {
+    show_menuitems(self);
   }
-
-  /* Save the hints */
-  /* FIXME: maybe don't do this every update */
-  save_filter_list_hints(self);
 }
 
 /**
- * update_do_not_disturb:
- * @self: the indicator object
+ * append_menuitem:
+ * @item: an item in the store
+ * @user_data: the indicator object
  *
- * Updates the icon with the do-not-disturb version and sets do-not-disturb options
- * on external notification daemons that are supported.
+ * A GFunc adding the menuitem of an item to the menu after the ones added
+ * since the notification menuitems were last removed.
  **/
 static void
-update_do_not_disturb(IndicatorNotifications *self)
+append_menuitem(gpointer item, gpointer user_data)
 {
-  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
+  GtkWidget *widget = item_menuitem(self, item);
 
-  update_unread(self);
+  gtk_menu_shell_insert(GTK_MENU_SHELL(self->priv->menu), widget,
+                        NOTIFICATIONS_POSITION + self->priv->search_shown);
+  g_object_unref(widget);
+  self->priv->search_shown++;
+}
 
-  /* Mate do-not-disturb support */
-  settings_try_set_boolean(MATE_SCHEMA, MATE_KEY_DND, self->priv->do_not_disturb);
+/**
+ * get_shown_length:
+ * @self: the indicator object
+ *
+ * Returns: the number of notification or group menuitems in the menu.
+ **/
+static guint
+get_shown_length(IndicatorNotifications *self)
+{
+  if(is_searching(self))
+    return self->priv->search_shown;
+  if(self->priv->group_by_app)
+    return self->priv->group_order.length;
+
+  return g_hash_table_size(self->priv->menuitems);
 }
 
 /**
- * settings_try_set_boolean:
- * @schema: the GSettings schema
- * @key: the GSettings key
- * @value: the boolean value
+ * item_menuitem:
+ * @self: the indicator object
+ * @item: an item in the store
  *
- * Checks to see if the schema and key exist before setting the value.
- */
-static void
-settings_try_set_boolean(const gchar *schema, const gchar *key, gboolean value)
+ * Creates a menuitem for the notification of an item.
+ *
+ * Returns: (transfer full): the menuitem.
+ **/
+static GtkWidget *
+item_menuitem(IndicatorNotifications *self, gpointer item)
 {
-  /* Check if we can access the schema */
-  GSettingsSchemaSource *source = g_settings_schema_source_get_default();
-  if (source == NULL) {
-    return;
-  }
+  GtkWidget *widget = new_menuitem(self, notification_store_get_notification(self->priv->store, item));
 
-  /* Lookup the schema */
-  GSettingsSchema *source_schema = g_settings_schema_source_lookup(source, schema, TRUE);
+  g_object_set_data(G_OBJECT(widget), ITEM_KEY, item);
 
-  /* Couldn't find the schema */
+  return widget;
+}
+
+/**
+ * update_group_by_app:
+ * @self: the indicator object
+ *
+ * Switches between grouped mode and a menuitem for each notification from
+ * GSettings.
+ **/
+static void
+update_group_by_app(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  gboolean group_by_app = g_settings_get_boolean(self->priv->settings, NOTIFICATIONS_KEY_GROUP_BY_APP);
+
+  if(group_by_app == self->priv->group_by_app)
+    return;
+
+  gtk_entry_set_text(GTK_ENTRY(self->priv->search_entry), "");
+  remove_notifications_from_menu(self);
+  clear_menuitem_table(self);
+  clear_groups(self);
+
+  self->priv->group_by_app = group_by_app;
+
+  if(group_by_app) {
+    /* Oldest first, so that the newest ends up on top */
+    notification_store_foreach_notification(self->priv->store, group_notification, self);
+    update_groups(self);
+  }
+  else {
+    show_menuitems(self);
+  }
+}
+
+/**
+ * group_notification:
+ * @data: a notification
+ * @user_data: the indicator object
+ *
+ * A GFunc raising the group of the notification's application.
+ **/
+static void
+group_notification(gpointer data, gpointer user_data)
+{
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
+
+  touch_group(self, notification_get_app_name((Notification *) data), TRUE);
+}
+
+/**
+ * update_max_items:
+ * @self: the indicator object
+ *
+ * Resizes the visible notifications from GSettings. While the menu is open,
+ * only the menuitems moving in or out of it are built or recycled.
+ **/
+static void
+update_max_items(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  /* The groups and search results don't depend on which notifications are
+   * visible, and a pending update places every menuitem anyway */
+  gboolean shown = !self->priv->group_by_app && !is_searching(self)
+                   && gtk_widget_get_visible(GTK_WIDGET(self->priv->menu))
+                   && self->priv->menu_update_tick_id == 0 && self->priv->menu_update_idle_id == 0;
+
+  self->priv->max_items = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_MAX_ITEMS);
+  notification_store_set_max_visible(self->priv->store, self->priv->max_items,
+                                     shown ? move_menuitem : NULL, self);
+
+  update_clear_item_markup(self);
+}
+
+/**
+ * move_menuitem:
+ * @item: the item of a notification at the edge of the visible window
+ * @user_data: the indicator object
+ *
+ * A GFunc putting the menuitem of a notification that became visible at the
+ * bottom of the others, or recycling the menuitem of one that became hidden.
+ **/
+static void
+move_menuitem(gpointer item, gpointer user_data)
+{
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
+  guint visible_length = notification_store_get_visible_length(self->priv->store);
+  GtkWidget *widget;
+
+  if(notification_store_is_visible(self->priv->store, item)) {
+    self->priv->search_shown = visible_length - 1;
+    place_menuitem(item, self);
+    return;
+  }
+
+  widget = g_hash_table_lookup(self->priv->menuitems, item);
+  if(widget != NULL) {
+    recycle_menuitem(self, widget);
+    g_hash_table_remove(self->priv->menuitems, item);
+    g_object_unref(widget);
+  }
+
+  self->priv->search_shown = visible_length;
+}
+
+/**
+ * touch_group:
+ * @self: the indicator object
+ * @app_name: the interned name of the application
+ * @raise: whether the application has a new notification
+ *
+ * Marks the group of an application as changed, creating it if needed. Raised
+ * and new groups move to the top of the menu. The labels are updated by
+ * update_groups().
+ **/
+static void
+touch_group(IndicatorNotifications *self, const gchar *app_name, gboolean raise)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  AppGroup *group = g_hash_table_lookup(self->priv->groups, app_name);
+
+  if(group == NULL) {
+    group = g_new0(AppGroup, 1);
+    group->self = self;
+    group->link.data = group;
+    group->app_name = g_ref_string_acquire((gchar *) app_name);
+
+    group->label = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(group->label), 0);
+    gtk_widget_show(group->label);
+
+    group->submenu = gtk_menu_new();
+
+    group->item = g_object_ref_sink(gtk_menu_item_new());
+    g_object_set_data(G_OBJECT(group->item), GROUP_KEY, group);
+    g_signal_connect(group->item, "select", G_CALLBACK(group_item_select_cb), group);
+    gtk_container_add(GTK_CONTAINER(group->item), group->label);
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(group->item), group->submenu);
+    gtk_widget_show(group->item);
+
+    g_hash_table_insert(self->priv->groups, (gpointer) group->app_name, group);
+    raise = TRUE;
+  }
+  else if(raise) {
+    g_queue_unlink(&self->priv->group_order, &group->link);
+  }
+
+  group->dirty = TRUE;
+
+  if(!raise)
+    return;
+
+  g_queue_push_head_link(&self->priv->group_order, &group->link);
+
+  /* The search results take the place of the groups */
+  if(is_searching(self))
+    return;
+
+  if(gtk_widget_get_parent(group->item) == NULL)
+    gtk_menu_shell_insert(GTK_MENU_SHELL(self->priv->menu), group->item, NOTIFICATIONS_POSITION);
+  else
+    gtk_menu_reorder_child(self->priv->menu, group->item, NOTIFICATIONS_POSITION);
+}
+
+/**
+ * update_groups:
+ * @self: the indicator object
+ *
+ * Updates the label of each group with its latest notification and count,
+ * and removes the groups left without notifications.
+ **/
+static void
+update_groups(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  GList *link = self->priv->group_order.head;
+
+  while(link != NULL) {
+    AppGroup *group = link->data;
+    guint length = notification_store_get_app_length(self->priv->store, group->app_name);
+
+    link = link->next;
+
+    if(length == 0) {
+      remove_group(self, group);
+      continue;
+    }
+
+    /* Only the oldest notifications are dropped without touching the group,
+     * and those can't be the latest unless they were all of them */
+    if(group->dirty) {
+      g_clear_pointer(&group->latest, notification_unref);
+      notification_store_foreach_app(self->priv->store, group->app_name, 1, find_latest, group);
+      group->dirty = FALSE;
+    }
+
+    gchar *markup = g_markup_printf_escaped("<b>%s</b> <small>(%u)</small>\n%s",
+                                            group->app_name, length,
+                                            notification_get_summary(group->latest));
+    gtk_label_set_markup(GTK_LABEL(group->label), markup);
+    g_free(markup);
+
+    /* Filled again from the store the next time it is opened */
+    if(!gtk_widget_get_visible(group->submenu))
+      release_submenu(group);
+  }
+}
+
+/**
+ * remove_group:
+ * @self: the indicator object
+ * @group: the group
+ *
+ * Removes a group from the menu and frees it.
+ **/
+static void
+remove_group(IndicatorNotifications *self, AppGroup *group)
+{
+  g_queue_unlink(&self->priv->group_order, &group->link);
+  g_hash_table_remove(self->priv->groups, group->app_name);
+}
+
+/**
+ * clear_groups:
+ * @self: the indicator object
+ *
+ * Removes all of the groups.
+ **/
+static void
+clear_groups(IndicatorNotifications *self)
+{
+  g_hash_table_remove_all(self->priv->groups);
+  g_queue_init(&self->priv->group_order);
+}
+
+/**
+ * group_free:
+ * @data: the group
+ *
+ * Removes the group's menuitem from the menu and frees the group.
+ **/
+static void
+group_free(gpointer data)
+{
+  AppGroup *group = (AppGroup *)data;
+  GtkWidget *parent = gtk_widget_get_parent(group->item);
+
+  if(parent != NULL)
+    gtk_container_remove(GTK_CONTAINER(parent), group->item);
+
+  gtk_widget_destroy(group->item);
+  g_object_unref(group->item);
+
+  if(group->latest != NULL)
+    notification_unref(group->latest);
+  g_ref_string_release((gchar *) group->app_name);
+  g_free(group);
+}
+
+/**
+ * release_submenu:
+ * @group: the group
+ *
+ * Recycles the menuitems in the group's submenu.
+ **/
+static void
+release_submenu(AppGroup *group)
+{
+  GList *children = gtk_container_get_children(GTK_CONTAINER(group->submenu));
+  GList *l;
+
+  for(l = children; l != NULL; l = l->next)
+    recycle_menuitem(group->self, GTK_WIDGET(l->data));
+
+  g_list_free(children);
+}
+
+/**
+ * update_submenu_menuitem:
+ * @group: the group
+ * @item: the item of a notification from the group's application
+ * @note: the notification of the item
+ *
+ * Updates the menuitem of the item in the group's submenu, which is only
+ * filled while it is open.
+ **/
+static void
+update_submenu_menuitem(AppGroup *group, gpointer item, Notification *note)
+{
+  GList *children = gtk_container_get_children(GTK_CONTAINER(group->submenu));
+  GList *l;
+
+  for(l = children; l != NULL; l = l->next) {
+    if(g_object_get_data(G_OBJECT(l->data), ITEM_KEY) == item) {
+      notification_menuitem_set_from_notification(NOTIFICATION_MENUITEM(l->data), note);
+      break;
+    }
+  }
+
+  g_list_free(children);
+}
+
+/**
+ * find_latest:
+ * @item: the newest item of the group's application
+ * @user_data: the group
+ *
+ * A GFunc keeping the notification of the item as the latest of the group.
+ **/
+static void
+find_latest(gpointer item, gpointer user_data)
+{
+  AppGroup *group = (AppGroup *)user_data;
+
+  group->latest = notification_ref(notification_store_get_notification(group->self->priv->store, item));
+}
+
+/**
+ * append_to_submenu:
+ * @item: an item of the group's application
+ * @user_data: the group
+ *
+ * A GFunc adding a menuitem for the item to the end of the group's submenu.
+ **/
+static void
+append_to_submenu(gpointer item, gpointer user_data)
+{
+  AppGroup *group = (AppGroup *)user_data;
+  GtkWidget *widget = item_menuitem(group->self, item);
+
+  gtk_menu_shell_append(GTK_MENU_SHELL(group->submenu), widget);
+  g_object_unref(widget);
+}
+
+/**
+ * set_unread:
+ * @self: the indicator object
+ * @unread: the unread status
+ *
+ * Sets the unread status of the indicator and updates the icons.
+ **/
+static void
+set_unread(IndicatorNotifications *self, gboolean unread)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  self->priv->have_unread = unread;
+  update_unread(self);
+}
+
+/**
+ * update_unread:
+ * @self: the indicator object
+ *
+ * Updates the indicator icons.
+ **/
+static void
+update_unread(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  if(self->priv->have_unread) {
+    if (self->priv->do_not_disturb) {
+      gtk_image_set_from_icon_name(self->priv->image, INDICATOR_ICON_UNREAD_DND, GTK_ICON_SIZE_MENU);
+    }
+    else {
+      gtk_image_set_from_icon_name(self->priv->image, INDICATOR_ICON_UNREAD, GTK_ICON_SIZE_MENU);
+    }
+  }
+  else {
+    if (self->priv->do_not_disturb) {
+      gtk_image_set_from_icon_name(self->priv->image, INDICATOR_ICON_READ_DND, GTK_ICON_SIZE_MENU);
+    }
+    else {
+      gtk_image_set_from_icon_name(self->priv->image, INDICATOR_ICON_READ, GTK_ICON_SIZE_MENU);
+    }
+  }
+}
+
+/**
+ * update_filter_list:
+ * @self: the indicator object
+ *
+ * Updates the filter list from GSettings. This currently does not filter already
+ * allowed messages. It only applies to messages received in the future. The
+ * filtering itself is done by the spy, before the messages reach the main loop.
+ **/
+static void
+update_filter_list(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  gchar **items = g_settings_get_strv(self->priv->settings, NOTIFICATIONS_KEY_FILTER_LIST);
+
+  dbus_spy_set_filter_list(self->priv->spy, (const gchar * const *) items);
+
+  g_strfreev(items);
+}
+
+/**
+ * update_queue_limit:
+ * @self: the indicator object
+ *
+ * Updates the size and overflow policy of the spy's queue from GSettings.
+ **/
+static void
+update_queue_limit(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  DBusSpyOverflowPolicy policy = DBUS_SPY_OVERFLOW_DROP_OLDEST;
+  gint size = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_QUEUE_SIZE);
+  gchar *policy_name = g_settings_get_string(self->priv->settings, NOTIFICATIONS_KEY_QUEUE_POLICY);
+
+  if(g_strcmp0(policy_name, "drop-newest") == 0)
+    policy = DBUS_SPY_OVERFLOW_DROP_NEWEST;
+  else if(g_strcmp0(policy_name, "collapse-per-app") == 0)
+    policy = DBUS_SPY_OVERFLOW_COLLAPSE_PER_APP;
+
+  g_free(policy_name);
+
+  dbus_spy_set_queue_limit(self->priv->spy, MAX(size, 1), policy);
+}
+
+/**
+ * update_rate_limit:
+ * @self: the indicator object
+ *
+ * Updates the per-application rate limit from GSettings.
+ **/
+static void
+update_rate_limit(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  gdouble rate = g_settings_get_double(self->priv->settings, NOTIFICATIONS_KEY_RATE_LIMIT);
+  gint burst = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_RATE_LIMIT_BURST);
+
+  rate_limiter_set_rate(self->priv->rate_limiter, rate, MAX(burst, 1));
+}
+
+/**
+ * update_history:
+ * @self: the indicator object
+ *
+ * Updates the number of notifications kept and whether they are kept across
+ * restarts from GSettings.
+ **/
+static void
+update_history(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  gboolean persist = g_settings_get_boolean(self->priv->settings, NOTIFICATIONS_KEY_HISTORY_PERSIST);
+  gint max_file_size = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_HISTORY_MAX_FILE_SIZE);
+
+  self->priv->history_size = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_HISTORY_SIZE);
+  notification_store_set_capacity(self->priv->store, self->priv->history_size);
+  update_groups(self);
+  update_clear_item_markup(self);
+
+  if(!persist && self->priv->history != NULL) {
+    notification_history_discard(self->priv->history);
+    self->priv->history = NULL;
+  }
+  else if(persist && self->priv->history == NULL) {
+    open_history(self, FALSE);
+  }
+  else if(self->priv->history != NULL) {
+    notification_history_set_limits(self->priv->history, self->priv->history_size,
+                                    (guint64) MAX(max_file_size, 1) * 1024);
+    sync_history(self);
+  }
+}
+
+/**
+ * open_history:
+ * @self: the indicator object
+ * @restore: whether to show the notifications from the last session
+ *
+ * Opens the history in the user's cache directory. Without @restore the
+ * history is rewritten with the notifications currently kept instead.
+ **/
+static void
+open_history(IndicatorNotifications *self, gboolean restore)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  g_return_if_fail(self->priv->history == NULL);
+
+  gint max_file_size = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_HISTORY_MAX_FILE_SIZE);
+  gchar *dir = g_build_filename(g_get_user_cache_dir(), HISTORY_DIR, NULL);
+  GPtrArray *restored = NULL;
+  GError *error = NULL;
+  guint i;
+
+  self->priv->history = notification_history_open(dir, self->priv->history_size,
+                                                   (guint64) MAX(max_file_size, 1) * 1024,
+                                                   &restored, &error);
+  g_free(dir);
+
+  if(self->priv->history == NULL) {
+    g_warning("Failed to open the notification history: %s", error->message);
+    g_error_free(error);
+    return;
+  }
+
+  /* Oldest first, so that the newest ends up on top */
+  if(restore) {
+    for(i = 0; i < restored->len; i++)
+      insert_notification(self, g_ptr_array_index(restored, i));
+    update_groups(self);
+  }
+  else {
+    g_ptr_array_set_size(restored, 0);
+    notification_store_foreach_notification(self->priv->store, collect_notification, restored);
+    notification_history_compact(self->priv->history, restored);
+  }
+
+  g_ptr_array_unref(restored);
+
+  sync_history(self);
+}
+
+/**
+ * sync_history:
+ * @self: the indicator object
+ *
+ * Writes out the history records written since the last call, compacting the
+ * history if it grew too large.
+ **/
+static void
+sync_history(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  if(self->priv->history == NULL)
+    return;
+
+  notification_history_flush(self->priv->history);
+
+  if(notification_history_needs_compaction(self->priv->history)) {
+    GPtrArray *notes = g_ptr_array_new_with_free_func((GDestroyNotify) notification_unref);
+
+    notification_store_foreach_notification(self->priv->store, collect_notification, notes);
+    notification_history_compact(self->priv->history, notes);
+    g_ptr_array_unref(notes);
+  }
+}
+
+/**
+ * collect_notification:
+ * @note: a notification
+ * @user_data: a GPtrArray freeing its notifications
+ *
+ * A GFunc adding a reference to the notification to the array.
+ **/
+static void
+collect_notification(gpointer note, gpointer user_data)
+{
+  g_ptr_array_add(user_data, notification_ref(note));
+}
+
+/**
+ * add_suppressed:
+ * @self: the indicator object
+ * @app_name: the application that went over the rate limit
+ *
+ * Counts a notification that was dropped by the rate limiter, in a single
+ * "N more from APP" menuitem per application placed below the notifications.
+ **/
+static void
+add_suppressed(IndicatorNotifications *self, const gchar *app_name)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  SuppressedItem *suppressed = g_hash_table_lookup(self->priv->suppressed_items, app_name);
+
+  if(suppressed == NULL) {
+    suppressed = g_new0(SuppressedItem, 1);
+    suppressed->item = gtk_menu_item_new_with_label("");
+    g_signal_connect(suppressed->item, "activate", G_CALLBACK(suppressed_item_activated_cb), self);
+    gtk_widget_show(suppressed->item);
+    gtk_menu_shell_insert(GTK_MENU_SHELL(self->priv->menu), suppressed->item,
+        NOTIFICATIONS_POSITION + get_shown_length(self));
+    g_hash_table_insert(self->priv->suppressed_items, g_strdup(app_name), suppressed);
+  }
+
+  suppressed->count++;
+
+  gchar *label = g_strdup_printf(ngettext("%u more from %s", "%u more from %s", suppressed->count),
+      suppressed->count, app_name);
+  gtk_menu_item_set_label(GTK_MENU_ITEM(suppressed->item), label);
+  g_free(label);
+}
+
+/**
+ * clear_suppressed:
+ * @self: the indicator object
+ *
+ * Removes all of the "N more from APP" menuitems.
+ **/
+static void
+clear_suppressed(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  g_hash_table_remove_all(self->priv->suppressed_items);
+}
+
+/**
+ * suppressed_item_free:
+ * @data: the suppressed item
+ *
+ * Removes the menuitem from the menu and frees the suppressed item.
+ **/
+static void
+suppressed_item_free(gpointer data)
+{
+  SuppressedItem *suppressed = (SuppressedItem *)data;
+  GtkWidget *parent = gtk_widget_get_parent(suppressed->item);
+
+  if(parent != NULL)
+    gtk_container_remove(GTK_CONTAINER(parent), suppressed->item);
+
+  g_free(suppressed);
+}
+
+/**
+ * update_clear_item_markup:
+ * @self: the indicator object
+ *
+ * Updates the clear menuitem's label markup based on the number of
+ * notifications available, and shows the search menuitem if there are any.
+ **/
+static void
+update_clear_item_markup(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  guint total_length = notification_store_get_length(self->priv->store);
+
+  gchar *markup = g_strdup_printf(ngettext(
+        "Clear <small>(%d Notification)</small>",
+        "Clear <small>(%d Notifications)</small>",
+        total_length),
+      total_length);
+
+  gtk_label_set_markup(GTK_LABEL(self->priv->clear_item_label), markup);
+  g_free(markup);
+
+  gtk_widget_set_visible(self->priv->search_item, total_length > 0 || is_searching(self));
+
+  if (total_length == 0) {
+    gtk_menu_shell_deactivate(GTK_MENU_SHELL(self->priv->menu));
+  }
+}
+
+/**
+ * update_indicator_visibility:
+ * @self: the indicator object
+ *
+ * Changes the visibility of the indicator image based on the value
+ * of hide_indicator.
+ **/
+static void
+update_indicator_visibility(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  
+  if(self->priv->image != NULL) {
+    if(self->priv->hide_indicator)
+      gtk_widget_hide(GTK_WIDGET(self->priv->image));
+    else
+      gtk_widget_show(GTK_WIDGET(self->priv->image));
+  }
+}
+
+/**
+ * load_filter_list_hints:
+ * @self: the indicator object
+ *
+ * Loads the filter list hints from gsettings
+ **/
+static void
+load_filter_list_hints(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  g_return_if_fail(self->priv->filter_list_hints == NULL);
+
+  gchar **items = g_settings_get_strv(self->priv->settings, NOTIFICATIONS_KEY_FILTER_LIST_HINTS);
+  int i;
+
+  for (i = 0; items[i] != NULL; i++) {
+    self->priv->filter_list_hints = g_list_prepend(self->priv->filter_list_hints, items[i]);
+  }
+
+  g_free(items);
+}
+
+/**
+ * save_filter_list_hints:
+ * @self: the indicator object
+ *
+ * Saves the filter list hints to gsettings
+ **/
+static void
+save_filter_list_hints(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  gchar *hints[HINT_MAX + 1];
+  int i = 0;
+
+  GList *l;
+  for (l = self->priv->filter_list_hints; (l != NULL) && (i < HINT_MAX); l = l->next, i++) {
+    hints[i] = (gchar *) l->data;
+  }
+
+  hints[i] = NULL;
+
+  g_settings_set_strv(self->priv->settings, NOTIFICATIONS_KEY_FILTER_LIST_HINTS, (const gchar **) hints);
+}
+
+/**
+ * update_filter_list_hints:
+ * @self: the indicator object
+ *
+ * Adds an application name to the hints. The caller is responsible for saving
+ * the hints if they changed.
+ *
+ * Returns: TRUE if the hints changed.
+ **/
+static gboolean
+update_filter_list_hints(IndicatorNotifications *self, Notification *notification)
+{
+  g_return_val_if_fail(IS_INDICATOR_NOTIFICATIONS(self), FALSE);
+  g_return_val_if_fail(notification != NULL, FALSE);
+
+  const gchar *appname = notification_get_app_name(notification);
+
+  /* Avoid duplicates */
+  GList *l;
+  for (l = self->priv->filter_list_hints; l != NULL; l = l->next) {
+    if (g_strcmp0(appname, (const gchar *) l->data) == 0)
+      return FALSE;
+  }
+
+  /* Add the appname */
+  self->priv->filter_list_hints = g_list_prepend(self->priv->filter_list_hints, g_strdup(appname));
+
+  /* Keep only a reasonable number */
+  while (g_list_length(self->priv->filter_list_hints) > HINT_MAX) {
+    GList *last = g_list_last(self->priv->filter_list_hints);
+    g_free(last->data);
+    self->priv->filter_list_hints = g_list_delete_link(self->priv->filter_list_hints, last);
+  }
+
+  return TRUE;
+}
+
+/**
+ * update_do_not_disturb:
+ * @self: the indicator object
+ *
+ * Updates the icon with the do-not-disturb version and sets do-not-disturb options
+ * on external notification daemons that are supported.
+ **/
+static void
+update_do_not_disturb(IndicatorNotifications *self)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+
+  update_unread(self);
+
+  /* Mate do-not-disturb support */
+  settings_try_set_boolean(MATE_SCHEMA, MATE_KEY_DND, self->priv->do_not_disturb);
+}
+
+/**
+ * settings_try_set_boolean:
+ * @schema: the GSettings schema
+ * @key: the GSettings key
+ * @value: the boolean value
+ *
+ * Checks to see if the schema and key exist before setting the value.
+ */
+static void
+settings_try_set_boolean(const gchar *schema, const gchar *key, gboolean value)
+{
+  /* Check if we can access the schema */
+  GSettingsSchemaSource *source = g_settings_schema_source_get_default();
+  if (source == NULL) {
+    return;
+  }
+
+  /* Lookup the schema */
+  GSettingsSchema *source_schema = g_settings_schema_source_lookup(source, schema, TRUE);
+
+  /* Couldn't find the schema */
   if (source_schema == NULL) {
     return;
   }
@@ -760,6 +1875,34 @@ settings_item_activated_cb(GtkMenuItem *menuitem, gpointer user_data)
   }
 }
 
+/**
+ * suppressed_item_activated_cb:
+ * @menuitem: the "N more from APP" menuitem
+ * @user_data: the indicator object
+ *
+ * Dismisses the counter when it is activated.
+ **/
+static void
+suppressed_item_activated_cb(GtkMenuItem *menuitem, gpointer user_data)
+{
+  g_return_if_fail(GTK_IS_MENU_ITEM(menuitem));
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(user_data));
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
+
+  g_hash_table_foreach_remove(self->priv->suppressed_items, suppressed_item_find, menuitem);
+}
+
+/**
+ * suppressed_item_find:
+ *
+ * A GHRFunc matching the suppressed item that owns the menuitem in @user_data.
+ **/
+static gboolean
+suppressed_item_find(gpointer key, gpointer value, gpointer user_data)
+{
+  return ((SuppressedItem *)value)->item == user_data;
+}
+
 /**
  * setting_changed_cb:
  * @settings: the GSettings object
@@ -788,12 +1931,32 @@ setting_changed_cb(GSettings *settings, gchar *key, gpointer user_data)
   else if(g_strcmp0(key, NOTIFICATIONS_KEY_FILTER_LIST) == 0) {
     update_filter_list(self);
   }
+  else if(g_strcmp0(key, NOTIFICATIONS_KEY_QUEUE_SIZE) == 0 ||
+          g_strcmp0(key, NOTIFICATIONS_KEY_QUEUE_POLICY) == 0) {
+    update_queue_limit(self);
+  }
+  else if(g_strcmp0(key, NOTIFICATIONS_KEY_RATE_LIMIT) == 0 ||
+          g_strcmp0(key, NOTIFICATIONS_KEY_RATE_LIMIT_BURST) == 0) {
+    update_rate_limit(self);
+  }
+  else if(g_strcmp0(key, NOTIFICATIONS_KEY_DEDUP_WINDOW) == 0) {
+    self->priv->dedup_window = g_settings_get_int(self->priv->settings, NOTIFICATIONS_KEY_DEDUP_WINDOW);
+  }
+  else if(g_strcmp0(key, NOTIFICATIONS_KEY_HISTORY_SIZE) == 0 ||
+          g_strcmp0(key, NOTIFICATIONS_KEY_HISTORY_PERSIST) == 0 ||
+          g_strcmp0(key, NOTIFICATIONS_KEY_HISTORY_MAX_FILE_SIZE) == 0) {
+    update_history(self);
+  }
+  else if(g_strcmp0(key, NOTIFICATIONS_KEY_GROUP_BY_APP) == 0) {
+    update_group_by_app(self);
+  }
   else if(g_strcmp0(key, NOTIFICATIONS_KEY_SWAP_CLEAR_SETTINGS) == 0) {
     self->priv->swap_clear_settings = g_settings_get_boolean(self->priv->settings, NOTIFICATIONS_KEY_SWAP_CLEAR_SETTINGS);
     swap_clear_settings_items(self);
   }
-  /* TODO: Trim or extend the notifications list based on "max-items" key
-   * (Currently requires a restart) */
+  else if(g_strcmp0(key, NOTIFICATIONS_KEY_MAX_ITEMS) == 0) {
+    update_max_items(self);
+  }
 }
 
 /**
@@ -813,59 +1976,366 @@ menu_visible_notify_cb(GtkWidget *menu, G_GNUC_UNUSED GParamSpec *pspec, gpointe
 
   gboolean visible;
   g_object_get(G_OBJECT(menu), "visible", &visible, NULL);
-  if(!visible) {
+  if(visible) {
+    /* The menuitems only exist while the menu is open */
+    if(!self->priv->group_by_app && !is_searching(self))
+      show_menuitems(self);
+  }
+  else {
     set_unread(self, FALSE);
+
+    /* An update waiting for the next frame won't get one once the menu is unmapped */
+    if(self->priv->menu_update_tick_id != 0)
+      update_menu(self);
+
+    /* Start over with the next search */
+    gtk_entry_set_text(GTK_ENTRY(self->priv->search_entry), "");
+
+    /* Let go of the menuitems once the menu is done with them */
+    if(self->priv->release_menuitems_id == 0)
+      self->priv->release_menuitems_id = g_idle_add(release_menuitems_cb, self);
   }
 }
 
 /**
- * message_received_cb:
- * @spy: the dbus notification monitor
+ * menu_key_press_cb:
+ * @menu: the menu
+ * @event: the key event
+ * @user_data: the indicator object
+ *
+ * Types into the search entry, which can't take the focus from the menu.
+ *
+ * Returns: TRUE if the key was used for the search.
+ **/
+static gboolean
+menu_key_press_cb(GtkWidget *menu, GdkEventKey *event, gpointer user_data)
+{
+  g_return_val_if_fail(IS_INDICATOR_NOTIFICATIONS(user_data), FALSE);
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
+
+  GtkEditable *editable = GTK_EDITABLE(self->priv->search_entry);
+  gint length = gtk_entry_get_text_length(GTK_ENTRY(self->priv->search_entry));
+  gunichar c = gdk_keyval_to_unicode(event->keyval);
+  gchar text[7];
+
+  if(!gtk_widget_get_visible(self->priv->search_item))
+    return FALSE;
+
+  if(event->keyval == GDK_KEY_BackSpace) {
+    if(length == 0)
+      return FALSE;
+
+    gtk_editable_delete_text(editable, length - 1, length);
+    return TRUE;
+  }
+
+  /* Space activates the selected menuitem until there is a query to add it to */
+  if((event->state & (GDK_CONTROL_MASK | GDK_MOD1_MASK)) != 0 ||
+     !g_unichar_isprint(c) || (c == ' ' && length == 0))
+    return FALSE;
+
+  text[g_unichar_to_utf8(c, text)] = '\0';
+  gtk_editable_insert_text(editable, text, -1, &length);
+
+  return TRUE;
+}
+
+/**
+ * search_item_button_release_cb:
+ *
+ * Keeps clicks on the search menuitem from activating it, which would close the menu.
+ **/
+static gboolean
+search_item_button_release_cb(GtkWidget *widget, GdkEventButton *event, gpointer user_data)
+{
+  return TRUE;
+}
+
+/**
+ * search_changed_cb:
+ * @editable: the search entry
+ * @user_data: the indicator object
+ *
+ * Called when the search query changes.
+ **/
+static void
+search_changed_cb(GtkEditable *editable, gpointer user_data)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(user_data));
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
+
+  update_search(self);
+  update_clear_item_markup(self);
+}
+
+/**
+ * group_item_select_cb:
+ * @menuitem: the group menuitem
+ * @user_data: the group
+ *
+ * Fills the group's submenu with the newest notifications of its application
+ * before it opens.
+ **/
+static void
+group_item_select_cb(GtkMenuItem *menuitem, gpointer user_data)
+{
+  AppGroup *group = (AppGroup *)user_data;
+  GList *children = gtk_container_get_children(GTK_CONTAINER(group->submenu));
+
+  if(children == NULL) {
+    notification_store_foreach_app(group->self->priv->store, group->app_name, GROUP_ITEMS_MAX,
+                                   append_to_submenu, group);
+  }
+
+  g_list_free(children);
+}
+
+/**
+ * release_menuitems_cb:
+ * @user_data: the indicator object
+ *
+ * Recycles the notification menuitems, including those in the submenu of
+ * every group, after the menu closed.
+ **/
+static gboolean
+release_menuitems_cb(gpointer user_data)
+{
+  g_return_val_if_fail(IS_INDICATOR_NOTIFICATIONS(user_data), G_SOURCE_REMOVE);
+  IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
+  GList *link;
+
+  self->priv->release_menuitems_id = 0;
+
+  /* Opened again in the meantime */
+  if(gtk_widget_get_visible(GTK_WIDGET(self->priv->menu)))
+    return G_SOURCE_REMOVE;
+
+  clear_menuitem_table(self);
+
+  for(link = self->priv->group_order.head; link != NULL; link = link->next)
+    release_submenu(link->data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * replace_notification:
+ * @self: the indicator object
+ * @item: the item of a notification in the store
+ * @note: the notification taking its place
+ *
+ * Shows a notification in place of an earlier one, updating its menuitem in
+ * the menu or in the open submenu of its group, the group and the history.
+ **/
+static void
+replace_notification(IndicatorNotifications *self, gpointer item, Notification *note)
+{
+  g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(self));
+  Notification *old = notification_store_get_notification(self->priv->store, item);
+  AppGroup *group = NULL;
+
+  if(self->priv->history != NULL) {
+    notification_history_remove(self->priv->history, old);
+    notification_history_append(self->priv->history, note);
+  }
+
+  if(self->priv->group_by_app) {
+    touch_group(self, notification_get_app_name(old), FALSE);
+    touch_group(self, notification_get_app_name(note), FALSE);
+
+    /* The menuitem can only be in the submenu of the old notification's group */
+    group = g_hash_table_lookup(self->priv->groups, notification_get_app_name(old));
+  }
+
+  notification_store_replace(self->priv->store, item, note);
+
+  if(is_searching(self)) {
+    queue_menu_update(self);
+  }
+  else if(group != NULL) {
+    update_submenu_menuitem(group, item, note);
+  }
+  else {
+    GtkWidget *widget = g_hash_table_lookup(self->priv->menuitems, item);
+
+    if(widget != NULL)
+      notification_menuitem_set_from_notification(NOTIFICATION_MENUITEM(widget), note);
+  }
+}
+
+/**
+ * add_notification:
+ * @self: the indicator object
  * @note: the notification received
+ * @hints_changed: set to TRUE if the filter list hints changed
+ *
+ * Creates a menuitem for the notification, or updates the menuitem of the
+ * notification it replaces. Notifications over the application's rate limit
+ * only update a counter.
+ *
+ * Returns: TRUE if a menuitem was inserted or updated.
+ **/
+static gboolean
+add_notification(IndicatorNotifications *self, Notification *note, gboolean *hints_changed)
+{
+  g_return_val_if_fail(IS_INDICATOR_NOTIFICATIONS(self), FALSE);
+  g_return_val_if_fail(note != NULL, FALSE);
+
+  /* Save a hint for the appname */
+  if(update_filter_list_hints(self, note))
+    *hints_changed = TRUE;
+
+  /* Update the menuitem in place if this notification replaces an earlier one */
+  if(notification_get_replaces_id(note) != 0) {
+    gpointer replaced = notification_store_lookup_id(self->priv->store, notification_get_replaces_id(note));
+
+    if(replaced != NULL) {
+      replace_notification(self, replaced, note);
+      return TRUE;
+    }
+  }
+
+  /* A repeat of a recent notification only bumps its counter and timestamp */
+  if(self->priv->dedup_window > 0) {
+    gpointer repeated = notification_store_lookup_duplicate(self->priv->store, note);
+
+    if(repeated != NULL) {
+      Notification *last = notification_store_get_notification(self->priv->store, repeated);
+
+      if(notification_get_timestamp_us(note) - notification_get_timestamp_us(last) <=
+         (gint64) self->priv->dedup_window * G_USEC_PER_SEC) {
+        notification_set_repeat_count(note, notification_get_repeat_count(last) + 1);
+        replace_notification(self, repeated, note);
+        return TRUE;
+      }
+    }
+  }
+
+  /* Fold notifications from applications over their rate into a counter */
+  if(!rate_limiter_allow(self->priv->rate_limiter, notification_get_app_name(note),
+                         g_get_monotonic_time())) {
+    add_suppressed(self, notification_get_app_name(note));
+    return TRUE;
+  }
+
+  insert_notification(self, note);
+
+  if(self->priv->history != NULL)
+    notification_history_append(self->priv->history, note);
+
+  return TRUE;
+}
+
+/**
+ * new_menuitem:
+ * @self: the indicator object
+ * @note: the notification
+ *
+ * Creates a shown menuitem for the notification, removed when clicked. A
+ * recycled menuitem is reused when there is one.
+ *
+ * Returns: (transfer full): the menuitem.
+ **/
+static GtkWidget *
+new_menuitem(IndicatorNotifications *self, Notification *note)
+{
+  GPtrArray *pool = self->priv->menuitem_pool;
+  GtkWidget *item;
+
+  if(pool->len > 0) {
+    /* The pool's ref becomes the caller's */
+    item = g_ptr_array_index(pool, pool->len - 1);
+    g_ptr_array_remove_index(pool, pool->len - 1);
+  }
+  else {
+    item = g_object_ref_sink(notification_menuitem_new());
+    g_signal_connect(item, NOTIFICATION_MENUITEM_SIGNAL_CLICKED, G_CALLBACK(notification_clicked_cb), self);
+    gtk_widget_show(item);
+  }
+
+  notification_menuitem_set_from_notification(NOTIFICATION_MENUITEM(item), note);
+
+  return item;
+}
+
+/**
+ * messages_received_cb:
+ * @spy: the dbus notification monitor
+ * @notes: the notifications received since the last batch
  * @user_data: the indicator object
  *
- * Called when a notification arrives on dbus.
+ * Called when a batch of notifications arrives on dbus. The menu, icon and
+ * hints are only updated once per batch.
  **/
 static void
-message_received_cb(DBusSpy *spy, Notification *note, gpointer user_data)
+messages_received_cb(DBusSpy *spy, GPtrArray *notes, gpointer user_data)
 {
   g_return_if_fail(IS_DBUS_SPY(spy));
-  g_return_if_fail(IS_NOTIFICATION(note));
+  g_return_if_fail(notes != NULL);
   g_return_if_fail(IS_INDICATOR_NOTIFICATIONS(user_data));
   IndicatorNotifications *self = INDICATOR_NOTIFICATIONS(user_data);
 
+  gboolean inserted = FALSE;
+  gboolean hints_changed = FALSE;
+  guint i;
+
+  report_lost_notifications(self);
+
   /* Discard notifications if we are hidden */
-  if(self->priv->hide_indicator) {
-    g_object_unref(note);
+  if(self->priv->hide_indicator)
     return;
+
+  for(i = 0; i < notes->len; i++) {
+    if(add_notification(self, g_ptr_array_index(notes, i), &hints_changed))
+      inserted = TRUE;
   }
 
-  /* Discard useless notifications */
-  if(notification_is_private(note) || notification_is_empty(note)) {
-    g_object_unref(note);
-    return;
+  if(hints_changed)
+    save_filter_list_hints(self);
+
+  /* The menu itself is updated by queue_menu_update() */
+  if(inserted) {
+    queue_menu_update(self);
+    if(!self->priv->have_unread)
+      set_unread(self, TRUE);
+    sync_history(self);
   }
+}
 
-  /* Discard notifications on the filter list */
-  if(self->priv->filter_list != NULL && g_hash_table_contains(self->priv->filter_list,
-        notification_get_app_name(note))) {
-    g_object_unref(note);
+/**
+ * report_lost_notifications:
+ * @self: the indicator object
+ *
+ * Logs the notifications the spy dropped from its queue or could not parse,
+ * if there are more than last time. Checked as each batch arrives, but logged
+ * no more than once every LOST_REPORT_INTERVAL.
+ **/
+static void
+report_lost_notifications(IndicatorNotifications *self)
+{
+  guint dropped_oldest;
+  guint dropped_newest;
+  guint collapsed;
+  guint malformed;
+  guint lost;
+  gint64 now = g_get_monotonic_time();
+
+  if(self->priv->lost_reported_at != 0 && now - self->priv->lost_reported_at < LOST_REPORT_INTERVAL)
     return;
-  }
 
-  /* Save a hint for the appname */
-  update_filter_list_hints(self, note);
+  dbus_spy_get_overflow_counts(self->priv->spy, &dropped_oldest, &dropped_newest, &collapsed);
+  malformed = dbus_spy_get_malformed_count(self->priv->spy);
+  lost = dropped_oldest + dropped_newest + collapsed + malformed;
 
-  /* Create the menuitem */
-  GtkWidget *item = notification_menuitem_new();
-  notification_menuitem_set_from_notification(NOTIFICATION_MENUITEM(item), note);
-  g_signal_connect(item, NOTIFICATION_MENUITEM_SIGNAL_CLICKED, G_CALLBACK(notification_clicked_cb), self);
-  gtk_widget_show(item);
-  g_object_unref(note);
+  if(lost == self->priv->lost_reported)
+    return;
 
-  insert_menuitem(self, item);
+  g_message("Lost %u notifications so far: %u oldest and %u newest dropped from a full queue, "
+            "%u replaced by a newer one from the same application and %u malformed",
+            lost, dropped_oldest, dropped_newest, collapsed, malformed);
 
-  set_unread(self, TRUE);
+  self->priv->lost_reported = lost;
+  self->priv->lost_reported_at = now;
 }
 
 /**
@@ -0,0 +1,822 @@
+/*
+ * notification-history.c - The notifications kept on disk across restarts.
+ *
+ * The history is an append-only log in two files, an index of fixed-size
+ * records and a heap holding their strings. Both start with a header with
+ * the same random generation, so an index is never read with the heap of
+ * another generation.
+ *
+ *   header: 8 byte magic, guint32 version, guint32 byte order mark,
+ *           guint64 generation
+ *   index:  HistoryRecord after HistoryRecord, 64 bytes each
+ *   heap:   the app name, icon, summary, body and markup of each
+ *           notification record, each nul-terminated, in record order
+ *
+ * Integers are in host byte order, a history from a machine with another
+ * byte order is simply discarded. Every record carries a checksum covering
+ * itself and its strings. At startup both files are mapped read-only and
+ * scanned up to the first torn or corrupt record, which is where a crash
+ * interrupted writing, and anything after it is truncated. The restored
+ * notifications keep their rendered markup, so they are shown without
+ * parsing them again.
+ *
+ * Nothing is rewritten in place. Removing a notification appends a
+ * tombstone, clearing appends a clear record. Once the log grows too large
+ * it is compacted into new files that replace the old ones by rename.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "fnv-hash.h"
+#include "notification-history.h"
+
+#define INDEX_MAGIC     "NOTIFIDX"
+#define HEAP_MAGIC      "NOTIFHEP"
+#define HISTORY_VERSION 1
+#define BYTE_ORDER_MARK 0x01020304
+
+#define INDEX_NAME "history.idx"
+#define HEAP_NAME  "history.heap"
+#define TMP_SUFFIX ".tmp"
+
+/* Compaction waits for this many records beyond twice the retained number */
+#define COMPACT_SLACK 64
+
+typedef enum {
+  RECORD_NOTIFICATION = 1,
+  RECORD_TOMBSTONE    = 2,
+  RECORD_CLEAR        = 3
+} RecordKind;
+
+enum {
+  FIELD_APP_NAME,
+  FIELD_APP_ICON,
+  FIELD_SUMMARY,
+  FIELD_BODY,
+  FIELD_MARKUP,
+  FIELD_COUNT
+};
+
+typedef struct {
+  gchar   magic[8];
+  guint32 version;
+  guint32 byte_order;
+  guint64 generation;
+} HistoryHeader;
+
+typedef struct {
+  /* Covers the rest of the record and its strings */
+  guint32 checksum;
+  guint32 kind;
+
+  /* Wall clock time in microseconds */
+  gint64  timestamp;
+
+  /* Where the strings start, always where those of the previous record end */
+  guint64 heap_offset;
+
+  /* The index of the record removed by a tombstone */
+  guint32 target;
+
+  /* The length of each string, without its nul */
+  guint32 lengths[FIELD_COUNT];
+
+  /* How many times the notification arrived, 0 in older files means once */
+  guint32 repeat_count;
+
+  guint32 reserved[3];
+} HistoryRecord;
+
+G_STATIC_ASSERT(sizeof(HistoryHeader) == 24);
+G_STATIC_ASSERT(sizeof(HistoryRecord) == 64);
+
+struct _NotificationHistory {
+  gchar   *index_path;
+  gchar   *heap_path;
+  FILE    *index_file;
+  FILE    *heap_file;
+
+  /* The records in the index, and bytes in the heap after its header */
+  guint32  record_count;
+  guint64  heap_size;
+
+  guint    max_records;
+  guint64  max_file_size;
+
+  /* Set once writing fails, nothing more is written after that */
+  gboolean failed;
+};
+
+static guint64    record_heap_length(const HistoryRecord *record);
+static gboolean   record_check(const HistoryRecord *record, guint32 index, const gchar *heap,
+                               guint64 heap_length, guint64 heap_offset);
+static gboolean   write_record(FILE *index_file, FILE *heap_file, guint64 *heap_size,
+                               HistoryRecord *record, const gchar * const *fields);
+static void       note_fields(Notification *note, const gchar **fields);
+static gboolean   create_files(const gchar *index_path, const gchar *heap_path,
+                               FILE **index_file, FILE **heap_file, GError **error);
+static void       history_recover(NotificationHistory *history);
+static GPtrArray *history_load(NotificationHistory *history);
+static gboolean   history_write(NotificationHistory *history, HistoryRecord *record,
+                                const gchar * const *fields);
+static void       history_close(NotificationHistory *history);
+
+/**
+ * notification_history_open:
+ * @dir: the directory holding the history, created if needed
+ * @max_records: the number of notifications to restore and keep
+ * @max_file_size: the size in bytes the files are compacted under
+ * @restored: (out): return location for the restored notifications, oldest first
+ * @error: return location for an error
+ *
+ * Opens the history, restoring the newest notifications from the previous
+ * session. A missing or unreadable history is replaced with an empty one.
+ *
+ * Returns: the history, or NULL if it could not be created.
+ **/
+NotificationHistory *
+notification_history_open(const gchar *dir, guint max_records, guint64 max_file_size,
+                          GPtrArray **restored, GError **error)
+{
+  g_return_val_if_fail(dir != NULL, NULL);
+  g_return_val_if_fail(restored != NULL, NULL);
+  NotificationHistory *history;
+
+  *restored = NULL;
+
+  if(g_mkdir_with_parents(dir, 0700) != 0) {
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Could not create %s: %s", dir, g_strerror(errno));
+    return NULL;
+  }
+
+  history = g_new0(NotificationHistory, 1);
+  history->index_path = g_build_filename(dir, INDEX_NAME, NULL);
+  history->heap_path = g_build_filename(dir, HEAP_NAME, NULL);
+  history->max_records = MAX(max_records, 1);
+  history->max_file_size = max_file_size;
+
+  history_recover(history);
+  *restored = history_load(history);
+
+  if(history->index_file == NULL &&
+     !create_files(history->index_path, history->heap_path,
+                   &history->index_file, &history->heap_file, error)) {
+    g_clear_pointer(restored, g_ptr_array_unref);
+    notification_history_free(history);
+    return NULL;
+  }
+
+  return history;
+}
+
+/**
+ * notification_history_free:
+ * @history: the history
+ *
+ * Writes out anything buffered and frees the history.
+ **/
+void
+notification_history_free(NotificationHistory *history)
+{
+  g_return_if_fail(history != NULL);
+
+  notification_history_flush(history);
+  history_close(history);
+  g_free(history->index_path);
+  g_free(history->heap_path);
+  g_free(history);
+}
+
+/**
+ * notification_history_discard:
+ * @history: the history
+ *
+ * Deletes the history files and frees the history.
+ **/
+void
+notification_history_discard(NotificationHistory *history)
+{
+  g_return_if_fail(history != NULL);
+
+  history_close(history);
+  g_unlink(history->index_path);
+  g_unlink(history->heap_path);
+  notification_history_free(history);
+}
+
+/**
+ * notification_history_set_limits:
+ * @history: the history
+ * @max_records: the number of notifications to restore and keep
+ * @max_file_size: the size in bytes the files are compacted under
+ *
+ * Changes the limits, which apply from the next compaction on.
+ **/
+void
+notification_history_set_limits(NotificationHistory *history, guint max_records, guint64 max_file_size)
+{
+  g_return_if_fail(history != NULL);
+
+  history->max_records = MAX(max_records, 1);
+  history->max_file_size = max_file_size;
+}
+
+/**
+ * notification_history_append:
+ * @history: the history
+ * @note: the notification
+ *
+ * Writes a notification, including its markup, to the end of the log.
+ **/
+void
+notification_history_append(NotificationHistory *history, Notification *note)
+{
+  g_return_if_fail(history != NULL);
+  g_return_if_fail(note != NULL);
+  HistoryRecord record = { 0 };
+  const gchar *fields[FIELD_COUNT];
+
+  record.kind = RECORD_NOTIFICATION;
+  record.timestamp = notification_get_timestamp_us(note);
+  record.repeat_count = notification_get_repeat_count(note);
+  note_fields(note, fields);
+
+  if(history_write(history, &record, fields))
+    notification_set_history_index(note, history->record_count);
+}
+
+/**
+ * notification_history_remove:
+ * @history: the history
+ * @note: the notification
+ *
+ * Marks a notification as removed, if it was written.
+ **/
+void
+notification_history_remove(NotificationHistory *history, Notification *note)
+{
+  g_return_if_fail(history != NULL);
+  g_return_if_fail(note != NULL);
+  HistoryRecord record = { 0 };
+  guint32 index = notification_get_history_index(note);
+
+  if(index == 0)
+    return;
+
+  record.kind = RECORD_TOMBSTONE;
+  record.timestamp = g_get_real_time();
+  record.target = index - 1;
+
+  history_write(history, &record, NULL);
+  notification_set_history_index(note, 0);
+}
+
+/**
+ * notification_history_clear:
+ * @history: the history
+ *
+ * Marks every notification written so far as removed.
+ **/
+void
+notification_history_clear(NotificationHistory *history)
+{
+  g_return_if_fail(history != NULL);
+  HistoryRecord record = { 0 };
+
+  record.kind = RECORD_CLEAR;
+  record.timestamp = g_get_real_time();
+
+  history_write(history, &record, NULL);
+}
+
+/**
+ * notification_history_flush:
+ * @history: the history
+ *
+ * Writes out the buffered records, the heap before the index so that no
+ * complete record is written ahead of its strings.
+ **/
+void
+notification_history_flush(NotificationHistory *history)
+{
+  g_return_if_fail(history != NULL);
+
+  if(history->failed || history->index_file == NULL)
+    return;
+
+  if(fflush(history->heap_file) != 0 || fflush(history->index_file) != 0) {
+    g_warning("Failed to write the notification history: %s", g_strerror(errno));
+    history->failed = TRUE;
+  }
+}
+
+/**
+ * notification_history_needs_compaction:
+ * @history: the history
+ *
+ * Returns: TRUE if the log has grown past its limits.
+ **/
+gboolean
+notification_history_needs_compaction(NotificationHistory *history)
+{
+  g_return_val_if_fail(history != NULL, FALSE);
+  guint64 size = 2 * sizeof(HistoryHeader) + (guint64) history->record_count * sizeof(HistoryRecord)
+    + history->heap_size;
+
+  if(history->failed)
+    return FALSE;
+
+  return history->record_count > 2 * history->max_records + COMPACT_SLACK || size > history->max_file_size;
+}
+
+/**
+ * notification_history_compact:
+ * @history: the history
+ * @notes: the notifications currently kept, oldest first
+ *
+ * Replaces the log with one holding only @notes. The oldest notifications are
+ * left out when all of them would take more than half the size limit, which
+ * leaves room for appending until the next compaction.
+ *
+ * Returns: TRUE on success.
+ **/
+gboolean
+notification_history_compact(NotificationHistory *history, GPtrArray *notes)
+{
+  g_return_val_if_fail(history != NULL, FALSE);
+  g_return_val_if_fail(notes != NULL, FALSE);
+  gchar *index_tmp = g_strconcat(history->index_path, TMP_SUFFIX, NULL);
+  gchar *heap_tmp = g_strconcat(history->heap_path, TMP_SUFFIX, NULL);
+  guint64 used = 2 * sizeof(HistoryHeader);
+  guint64 heap_size = 0;
+  FILE *index_file;
+  FILE *heap_file;
+  GError *error = NULL;
+  gboolean ok = TRUE;
+  guint first;
+  guint i;
+
+  /* Keep the newest notifications that fit */
+  for(first = notes->len; first > 0 && notes->len - first < history->max_records; first--) {
+    const gchar *fields[FIELD_COUNT];
+    guint64 size = sizeof(HistoryRecord);
+
+    note_fields(g_ptr_array_index(notes, first - 1), fields);
+    for(i = 0; i < FIELD_COUNT; i++)
+      size += strlen(fields[i]) + 1;
+
+    if(used + size > history->max_file_size / 2)
+      break;
+    used += size;
+  }
+
+  if(!create_files(index_tmp, heap_tmp, &index_file, &heap_file, &error)) {
+    g_warning("Failed to compact the notification history: %s", error->message);
+    g_error_free(error);
+    g_free(index_tmp);
+    g_free(heap_tmp);
+    return FALSE;
+  }
+
+  for(i = first; ok && i < notes->len; i++) {
+    Notification *note = g_ptr_array_index(notes, i);
+    HistoryRecord record = { 0 };
+    const gchar *fields[FIELD_COUNT];
+
+    record.kind = RECORD_NOTIFICATION;
+    record.timestamp = notification_get_timestamp_us(note);
+    record.repeat_count = notification_get_repeat_count(note);
+    note_fields(note, fields);
+
+    ok = write_record(index_file, heap_file, &heap_size, &record, fields);
+  }
+
+  /* Both files have to be on disk before they replace the old ones */
+  ok = ok && fflush(heap_file) == 0 && fsync(fileno(heap_file)) == 0
+          && fflush(index_file) == 0 && fsync(fileno(index_file)) == 0;
+  ok = fclose(heap_file) == 0 && ok;
+  ok = fclose(index_file) == 0 && ok;
+
+  /* The heap goes first. If the index can't follow it, the temporary index
+   * left behind completes the compaction the next time the history is opened. */
+  if(!ok || g_rename(heap_tmp, history->heap_path) != 0) {
+    g_warning("Failed to compact the notification history: %s", g_strerror(errno));
+    g_unlink(index_tmp);
+    g_unlink(heap_tmp);
+    g_free(index_tmp);
+    g_free(heap_tmp);
+    return FALSE;
+  }
+
+  ok = g_rename(index_tmp, history->index_path) == 0;
+  g_free(index_tmp);
+  g_free(heap_tmp);
+
+  /* The old files are gone either way */
+  history_close(history);
+
+  if(!ok) {
+    g_warning("Failed to compact the notification history: %s", g_strerror(errno));
+    history->failed = TRUE;
+    return FALSE;
+  }
+
+  history->index_file = g_fopen(history->index_path, "ab");
+  history->heap_file = g_fopen(history->heap_path, "ab");
+  history->record_count = notes->len - first;
+  history->heap_size = heap_size;
+  history->failed = FALSE;
+
+  if(history->index_file == NULL || history->heap_file == NULL) {
+    g_warning("Failed to open the notification history: %s", g_strerror(errno));
+    history->failed = TRUE;
+  }
+
+  for(i = 0; i < notes->len; i++)
+    notification_set_history_index(g_ptr_array_index(notes, i), i < first ? 0 : i - first + 1);
+
+  return !history->failed;
+}
+
+/**
+ * record_heap_length:
+ * @record: a record
+ *
+ * Returns: the number of bytes the strings of the record take in the heap.
+ **/
+static guint64
+record_heap_length(const HistoryRecord *record)
+{
+  guint64 length = 0;
+  guint i;
+
+  if(record->kind != RECORD_NOTIFICATION)
+    return 0;
+
+  for(i = 0; i < FIELD_COUNT; i++)
+    length += (guint64) record->lengths[i] + 1;
+
+  return length;
+}
+
+/**
+ * record_check:
+ * @record: the record read from the index
+ * @index: its index
+ * @heap: the heap, after its header
+ * @heap_length: the length of @heap
+ * @heap_offset: where the strings of the record have to start
+ *
+ * Returns: TRUE if the record is complete and intact.
+ **/
+static gboolean
+record_check(const HistoryRecord *record, guint32 index, const gchar *heap,
+             guint64 heap_length, guint64 heap_offset)
+{
+  guint32 hash;
+  const gchar *str;
+  guint i;
+
+  if(record->heap_offset != heap_offset)
+    return FALSE;
+
+  switch(record->kind) {
+    case RECORD_NOTIFICATION:
+      if(record_heap_length(record) > heap_length - heap_offset)
+        return FALSE;
+
+      for(i = 0, str = heap + heap_offset; i < FIELD_COUNT; str += record->lengths[i] + 1, i++) {
+        if(str[record->lengths[i]] != '\0')
+          return FALSE;
+      }
+      break;
+    case RECORD_TOMBSTONE:
+      if(record->target >= index)
+        return FALSE;
+      break;
+    case RECORD_CLEAR:
+      break;
+    default:
+      return FALSE;
+  }
+
+  hash = fnv_hash_update(FNV_HASH_INIT, &record->kind,
+                         sizeof(HistoryRecord) - G_STRUCT_OFFSET(HistoryRecord, kind));
+  hash = fnv_hash_update(hash, heap + heap_offset, record_heap_length(record));
+
+  return hash == record->checksum;
+}
+
+/**
+ * write_record:
+ * @index_file: the index
+ * @heap_file: the heap
+ * @heap_size: the size of the heap, updated
+ * @record: the record with its kind, timestamp and target set
+ * @fields: (nullable): the strings of a notification record
+ *
+ * Fills in the rest of the record and writes it with its strings.
+ *
+ * Returns: FALSE if writing failed.
+ **/
+static gboolean
+write_record(FILE *index_file, FILE *heap_file, guint64 *heap_size,
+             HistoryRecord *record, const gchar * const *fields)
+{
+  guint32 hash;
+  guint i;
+
+  record->heap_offset = *heap_size;
+
+  if(fields != NULL) {
+    for(i = 0; i < FIELD_COUNT; i++)
+      record->lengths[i] = strlen(fields[i]);
+  }
+
+  hash = fnv_hash_update(FNV_HASH_INIT, &record->kind,
+                         sizeof(HistoryRecord) - G_STRUCT_OFFSET(HistoryRecord, kind));
+
+  if(fields != NULL) {
+    for(i = 0; i < FIELD_COUNT; i++) {
+      if(fwrite(fields[i], record->lengths[i] + 1, 1, heap_file) != 1)
+        return FALSE;
+      hash = fnv_hash_update(hash, fields[i], record->lengths[i] + 1);
+    }
+  }
+
+  record->checksum = hash;
+
+  if(fwrite(record, sizeof(HistoryRecord), 1, index_file) != 1)
+    return FALSE;
+
+  *heap_size += record_heap_length(record);
+
+  return TRUE;
+}
+
+/**
+ * note_fields:
+ * @note: a notification
+ * @fields: (out caller-allocates): the FIELD_COUNT strings to store for it
+ **/
+static void
+note_fields(Notification *note, const gchar **fields)
+{
+  const gchar *markup = notification_get_markup(note);
+
+  fields[FIELD_APP_NAME] = notification_get_app_name(note);
+  fields[FIELD_APP_ICON] = notification_get_app_icon(note);
+  fields[FIELD_SUMMARY] = notification_get_summary(note);
+  fields[FIELD_BODY] = notification_get_body(note);
+  fields[FIELD_MARKUP] = markup != NULL ? markup : "";
+}
+
+/**
+ * create_files:
+ * @index_path: the index to create
+ * @heap_path: the heap to create
+ * @index_file: (out): return location for the open index
+ * @heap_file: (out): return location for the open heap
+ * @error: return location for an error
+ *
+ * Creates an empty history with a new generation, replacing existing files.
+ * The heap is created first, see history_recover().
+ *
+ * Returns: FALSE on error.
+ **/
+static gboolean
+create_files(const gchar *index_path, const gchar *heap_path,
+             FILE **index_file, FILE **heap_file, GError **error)
+{
+  HistoryHeader header = { { 0 } };
+
+  header.version = HISTORY_VERSION;
+  header.byte_order = BYTE_ORDER_MARK;
+  header.generation = ((guint64) g_random_int() << 32) | g_random_int();
+
+  *index_file = NULL;
+  *heap_file = g_fopen(heap_path, "wb");
+
+  if(*heap_file != NULL) {
+    memcpy(header.magic, HEAP_MAGIC, sizeof(header.magic));
+    if(fwrite(&header, sizeof(header), 1, *heap_file) == 1)
+      *index_file = g_fopen(index_path, "wb");
+  }
+
+  if(*index_file != NULL) {
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    if(fwrite(&header, sizeof(header), 1, *index_file) == 1)
+      return TRUE;
+  }
+
+  g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+              "Could not create %s: %s", *index_file == NULL && *heap_file != NULL ? index_path : heap_path,
+              g_strerror(errno));
+
+  if(*index_file != NULL)
+    fclose(*index_file);
+  if(*heap_file != NULL)
+    fclose(*heap_file);
+  *index_file = NULL;
+  *heap_file = NULL;
+
+  return FALSE;
+}
+
+/**
+ * history_recover:
+ * @history: the history
+ *
+ * Cleans up after a compaction that was interrupted. A temporary index
+ * without a temporary heap means the heap was already renamed, so renaming
+ * the index completes it. Otherwise the old files are still intact.
+ **/
+static void
+history_recover(NotificationHistory *history)
+{
+  gchar *index_tmp = g_strconcat(history->index_path, TMP_SUFFIX, NULL);
+  gchar *heap_tmp = g_strconcat(history->heap_path, TMP_SUFFIX, NULL);
+
+  if(g_file_test(index_tmp, G_FILE_TEST_EXISTS) && !g_file_test(heap_tmp, G_FILE_TEST_EXISTS))
+    g_rename(index_tmp, history->index_path);
+
+  g_unlink(index_tmp);
+  g_unlink(heap_tmp);
+
+  g_free(index_tmp);
+  g_free(heap_tmp);
+}
+
+/**
+ * history_load:
+ * @history: the history
+ *
+ * Reads the intact part of the history and opens it for appending after
+ * that. Leaves the files closed if there is no usable history.
+ *
+ * Returns: (transfer full): the newest notifications still kept, oldest first.
+ **/
+static GPtrArray *
+history_load(NotificationHistory *history)
+{
+  GPtrArray *notes = g_ptr_array_new_with_free_func((GDestroyNotify) notification_unref);
+  GMappedFile *index_map = g_mapped_file_new(history->index_path, FALSE, NULL);
+  GMappedFile *heap_map = g_mapped_file_new(history->heap_path, FALSE, NULL);
+  HistoryHeader index_header;
+  HistoryHeader heap_header;
+  HistoryRecord record;
+  const gchar *index_data;
+  const gchar *heap;
+  guint64 heap_length;
+  guint8 *removed;
+  guint32 count;
+  guint32 start = 0;
+  guint32 first;
+  guint32 kept = 0;
+  guint32 i;
+
+  if(index_map == NULL || heap_map == NULL
+     || g_mapped_file_get_length(index_map) < sizeof(HistoryHeader)
+     || g_mapped_file_get_length(heap_map) < sizeof(HistoryHeader)) {
+    if(index_map != NULL || heap_map != NULL)
+      g_warning("Discarding the incomplete notification history in %s", history->index_path);
+    g_clear_pointer(&index_map, g_mapped_file_unref);
+    g_clear_pointer(&heap_map, g_mapped_file_unref);
+    return notes;
+  }
+
+  memcpy(&index_header, g_mapped_file_get_contents(index_map), sizeof(HistoryHeader));
+  memcpy(&heap_header, g_mapped_file_get_contents(heap_map), sizeof(HistoryHeader));
+
+  if(memcmp(index_header.magic, INDEX_MAGIC, sizeof(index_header.magic)) != 0
+     || memcmp(heap_header.magic, HEAP_MAGIC, sizeof(heap_header.magic)) != 0
+     || index_header.version != HISTORY_VERSION || heap_header.version != HISTORY_VERSION
+     || index_header.byte_order != BYTE_ORDER_MARK || heap_header.byte_order != BYTE_ORDER_MARK
+     || index_header.generation != heap_header.generation) {
+    g_warning("Discarding the unreadable notification history in %s", history->index_path);
+    g_mapped_file_unref(index_map);
+    g_mapped_file_unref(heap_map);
+    return notes;
+  }
+
+  index_data = g_mapped_file_get_contents(index_map) + sizeof(HistoryHeader);
+  heap = g_mapped_file_get_contents(heap_map) + sizeof(HistoryHeader);
+  heap_length = g_mapped_file_get_length(heap_map) - sizeof(HistoryHeader);
+  count = MIN((g_mapped_file_get_length(index_map) - sizeof(HistoryHeader)) / sizeof(HistoryRecord),
+              G_MAXUINT32 - 1);
+  removed = g_new0(guint8, count + 1);
+
+  /* Find the intact records, applying the tombstones and clear records */
+  for(i = 0; i < count; i++) {
+    memcpy(&record, index_data + (gsize) i * sizeof(HistoryRecord), sizeof(HistoryRecord));
+
+    if(!record_check(&record, i, heap, heap_length, history->heap_size))
+      break;
+
+    if(record.kind == RECORD_CLEAR)
+      start = i + 1;
+    else if(record.kind == RECORD_TOMBSTONE)
+      removed[record.target] = TRUE;
+
+    history->heap_size += record_heap_length(&record);
+  }
+
+  history->record_count = count = i;
+
+  /* Only the newest are restored */
+  for(first = count; first > start && kept < history->max_records; first--) {
+    memcpy(&record, index_data + (gsize) (first - 1) * sizeof(HistoryRecord), sizeof(HistoryRecord));
+    if(record.kind == RECORD_NOTIFICATION && !removed[first - 1])
+      kept++;
+  }
+
+  for(i = first; i < count; i++) {
+    const gchar *fields[FIELD_COUNT];
+    const gchar *str;
+    Notification *note;
+    guint j;
+
+    memcpy(&record, index_data + (gsize) i * sizeof(HistoryRecord), sizeof(HistoryRecord));
+    if(record.kind != RECORD_NOTIFICATION || removed[i])
+      continue;
+
+    for(j = 0, str = heap + record.heap_offset; j < FIELD_COUNT; str += record.lengths[j] + 1, j++)
+      fields[j] = str;
+
+    note = notification_new_full(fields[FIELD_APP_NAME], fields[FIELD_APP_ICON],
+                                 fields[FIELD_SUMMARY], record.lengths[FIELD_SUMMARY],
+                                 fields[FIELD_BODY], record.lengths[FIELD_BODY],
+                                 record.timestamp);
+    if(record.lengths[FIELD_MARKUP] > 0)
+      notification_set_markup(note, g_strndup(fields[FIELD_MARKUP], record.lengths[FIELD_MARKUP]));
+    notification_set_repeat_count(note, record.repeat_count);
+    notification_set_history_index(note, i + 1);
+
+    g_ptr_array_add(notes, note);
+  }
+
+  g_free(removed);
+  g_mapped_file_unref(index_map);
+  g_mapped_file_unref(heap_map);
+
+  /* Cut off anything after the last intact record, then append after it */
+  if(truncate(history->index_path,
+              sizeof(HistoryHeader) + (guint64) history->record_count * sizeof(HistoryRecord)) == 0
+     && truncate(history->heap_path, sizeof(HistoryHeader) + history->heap_size) == 0) {
+    history->index_file = g_fopen(history->index_path, "ab");
+    history->heap_file = g_fopen(history->heap_path, "ab");
+  }
+
+  if(history->index_file == NULL || history->heap_file == NULL) {
+    g_warning("Failed to open the notification history: %s", g_strerror(errno));
+    history_close(history);
+    history->record_count = 0;
+    history->heap_size = 0;
+    g_ptr_array_set_size(notes, 0);
+  }
+
+  return notes;
+}
+
+/**
+ * history_write:
+ * @history: the history
+ * @record: the record with its kind, timestamp and target set
+ * @fields: (nullable): the strings of a notification record
+ *
+ * Appends a record, giving up on the history if that fails.
+ *
+ * Returns: TRUE if the record was written.
+ **/
+static gboolean
+history_write(NotificationHistory *history, HistoryRecord *record, const gchar * const *fields)
+{
+  if(history->failed || history->index_file == NULL)
+    return FALSE;
+
+  if(!write_record(history->index_file, history->heap_file, &history->heap_size, record, fields)) {
+    g_warning("Failed to write the notification history: %s", g_strerror(errno));
+    history->failed = TRUE;
+    return FALSE;
+  }
+
+  history->record_count++;
+
+  return TRUE;
+}
+
+/**
+ * history_close:
+ * @history: the history
+ *
+ * Closes the files. Write errors are only reported by notification_history_flush().
+ **/
+static void
+history_close(NotificationHistory *history)
+{
+  g_clear_pointer(&history->index_file, fclose);
+  g_clear_pointer(&history->heap_file, fclose);
+}
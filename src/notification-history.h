@@ -0,0 +1,31 @@
+/*
+ * notification-history.h - The notifications kept on disk across restarts.
+ */
+
+#ifndef __NOTIFICATION_HISTORY_H__
+#define __NOTIFICATION_HISTORY_H__
+
+#include <glib.h>
+
+#include "notification.h"
+
+G_BEGIN_DECLS
+
+typedef struct _NotificationHistory NotificationHistory;
+
+NotificationHistory *notification_history_open(const gchar *dir, guint max_records, guint64 max_file_size,
+                                               GPtrArray **restored, GError **error);
+void                 notification_history_free(NotificationHistory *history);
+void                 notification_history_discard(NotificationHistory *history);
+void                 notification_history_set_limits(NotificationHistory *history, guint max_records,
+                                                     guint64 max_file_size);
+void                 notification_history_append(NotificationHistory *history, Notification *note);
+void                 notification_history_remove(NotificationHistory *history, Notification *note);
+void                 notification_history_clear(NotificationHistory *history);
+void                 notification_history_flush(NotificationHistory *history);
+gboolean             notification_history_needs_compaction(NotificationHistory *history);
+gboolean             notification_history_compact(NotificationHistory *history, GPtrArray *notes);
+
+G_END_DECLS
+
+#endif /* __NOTIFICATION_HISTORY_H__ */
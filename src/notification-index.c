@@ -0,0 +1,289 @@
+/*
+ * notification-index.c - A trigram index for searching notifications.
+ *
+ * The app name, summary and body of each notification are casefolded into
+ * one text, and every three byte sequence in it is a trigram. Each trigram
+ * has a posting list of the ids of the documents containing it, in ascending
+ * order. A query word of three bytes or more can only occur in documents that
+ * are in the posting lists of all its trigrams, so the shortest of those lists
+ * gives the candidates, which are then checked against their text. Queries
+ * with only shorter words are checked against every document.
+ *
+ * Documents get increasing ids, so adding one only appends to posting lists.
+ * Removing one leaves its id in the lists until enough of them are stale,
+ * then all of the lists are purged at once.
+ */
+
+#include <string.h>
+#include "notification-index.h"
+
+/* The trigram starting at s, never 0 since the text has no nul bytes */
+#define TRIGRAM(s) (((guint32) (guchar) (s)[0] << 16) | ((guint32) (guchar) (s)[1] << 8) | (guchar) (s)[2])
+
+typedef struct {
+  gpointer  key;
+
+  /* The casefolded app name, summary and body separated by newlines */
+  gchar    *text;
+
+  /* The posting lists the document was added to */
+  guint     trigram_count;
+} Document;
+
+struct _NotificationIndex {
+  /* Trigram to GArray of guint32 document ids */
+  GHashTable *postings;
+
+  /* Document id to Document, and key to document id */
+  GHashTable *documents;
+  GHashTable *by_key;
+  guint32     next_id;
+
+  /* Ids in the posting lists, and those of them belonging to removed documents */
+  gsize       posting_count;
+  gsize       stale_count;
+};
+
+static void     document_free(gpointer data);
+static gboolean document_matches(Document *doc, gchar **words);
+static void     index_purge(NotificationIndex *index);
+
+/**
+ * notification_index_new:
+ *
+ * Creates an empty index.
+ **/
+NotificationIndex *
+notification_index_new(void)
+{
+  NotificationIndex *index = g_new0(NotificationIndex, 1);
+
+  index->postings = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) g_array_unref);
+  index->documents = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, document_free);
+  index->by_key = g_hash_table_new(g_direct_hash, g_direct_equal);
+  index->next_id = 1;
+
+  return index;
+}
+
+/**
+ * notification_index_free:
+ * @index: the index
+ **/
+void
+notification_index_free(NotificationIndex *index)
+{
+  g_return_if_fail(index != NULL);
+
+  g_hash_table_unref(index->postings);
+  g_hash_table_unref(index->documents);
+  g_hash_table_unref(index->by_key);
+  g_free(index);
+}
+
+/**
+ * notification_index_add:
+ * @index: the index
+ * @key: the key the notification is found by
+ * @note: the notification
+ *
+ * Indexes the text of a notification, replacing whatever was indexed under
+ * @key before.
+ **/
+void
+notification_index_add(NotificationIndex *index, gpointer key, Notification *note)
+{
+  g_return_if_fail(index != NULL);
+  g_return_if_fail(note != NULL);
+  Document *doc = g_new0(Document, 1);
+  guint32 id;
+  gchar *text;
+  gsize length;
+  gsize i;
+
+  notification_index_remove(index, key);
+
+  text = g_strjoin("\n", notification_get_app_name(note), notification_get_summary(note),
+                   notification_get_body(note), NULL);
+  doc->key = key;
+  doc->text = g_utf8_casefold(text, -1);
+  g_free(text);
+
+  id = index->next_id++;
+  length = strlen(doc->text);
+
+  for(i = 0; i + 3 <= length; i++) {
+    gpointer trigram = GUINT_TO_POINTER(TRIGRAM(doc->text + i));
+    GArray *list = g_hash_table_lookup(index->postings, trigram);
+
+    if(list == NULL) {
+      list = g_array_new(FALSE, FALSE, sizeof(guint32));
+      g_hash_table_insert(index->postings, trigram, list);
+    }
+    /* A trigram seen earlier in the text already ends with this id */
+    else if(g_array_index(list, guint32, list->len - 1) == id) {
+      continue;
+    }
+
+    g_array_append_val(list, id);
+    doc->trigram_count++;
+  }
+
+  index->posting_count += doc->trigram_count;
+
+  g_hash_table_insert(index->documents, GUINT_TO_POINTER(id), doc);
+  g_hash_table_insert(index->by_key, key, GUINT_TO_POINTER(id));
+}
+
+/**
+ * notification_index_remove:
+ * @index: the index
+ * @key: the key of the notification
+ *
+ * Removes a notification from the index, if it is indexed.
+ **/
+void
+notification_index_remove(NotificationIndex *index, gpointer key)
+{
+  g_return_if_fail(index != NULL);
+  gpointer id;
+  Document *doc;
+
+  if(!g_hash_table_lookup_extended(index->by_key, key, NULL, &id))
+    return;
+
+  doc = g_hash_table_lookup(index->documents, id);
+  index->stale_count += doc->trigram_count;
+
+  g_hash_table_remove(index->by_key, key);
+  g_hash_table_remove(index->documents, id);
+
+  /* Purging visits every id, so wait until enough are stale to make it worthwhile */
+  if(index->stale_count > index->posting_count / 2)
+    index_purge(index);
+}
+
+/**
+ * notification_index_search:
+ * @index: the index
+ * @query: the words to look for, separated by whitespace
+ *
+ * Finds the notifications containing every word of the query, ignoring case.
+ *
+ * Returns: (transfer full): the set of keys of the matching notifications.
+ **/
+GHashTable *
+notification_index_search(NotificationIndex *index, const gchar *query)
+{
+  g_return_val_if_fail(index != NULL, NULL);
+  g_return_val_if_fail(query != NULL, NULL);
+  GHashTable *matches = g_hash_table_new(g_direct_hash, g_direct_equal);
+  gchar *folded = g_utf8_casefold(query, -1);
+  gchar **words = g_strsplit_set(folded, " \t\n", -1);
+  GArray *shortest = NULL;
+  gboolean possible = TRUE;
+  Document *doc;
+  guint i;
+
+  g_free(folded);
+
+  /* Every match is in the posting list of each trigram of each word */
+  for(i = 0; possible && words[i] != NULL; i++) {
+    gsize length = strlen(words[i]);
+    gsize j;
+
+    for(j = 0; possible && j + 3 <= length; j++) {
+      GArray *list = g_hash_table_lookup(index->postings, GUINT_TO_POINTER(TRIGRAM(words[i] + j)));
+
+      if(list == NULL)
+        possible = FALSE;
+      else if(shortest == NULL || list->len < shortest->len)
+        shortest = list;
+    }
+  }
+
+  if(possible && shortest != NULL) {
+    for(i = 0; i < shortest->len; i++) {
+      doc = g_hash_table_lookup(index->documents, GUINT_TO_POINTER(g_array_index(shortest, guint32, i)));
+
+      if(doc != NULL && document_matches(doc, words))
+        g_hash_table_add(matches, doc->key);
+    }
+  }
+  else if(possible) {
+    GHashTableIter iter;
+
+    g_hash_table_iter_init(&iter, index->documents);
+    while(g_hash_table_iter_next(&iter, NULL, (gpointer *) &doc)) {
+      if(document_matches(doc, words))
+        g_hash_table_add(matches, doc->key);
+    }
+  }
+
+  g_strfreev(words);
+
+  return matches;
+}
+
+static void
+document_free(gpointer data)
+{
+  Document *doc = data;
+
+  g_free(doc->text);
+  g_free(doc);
+}
+
+/**
+ * document_matches:
+ * @doc: a document
+ * @words: the casefolded query words, some of which can be empty
+ *
+ * Returns: TRUE if the document contains every word.
+ **/
+static gboolean
+document_matches(Document *doc, gchar **words)
+{
+  guint i;
+
+  for(i = 0; words[i] != NULL; i++) {
+    if(words[i][0] != '\0' && strstr(doc->text, words[i]) == NULL)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * index_purge:
+ * @index: the index
+ *
+ * Drops the ids of removed documents from the posting lists.
+ **/
+static void
+index_purge(NotificationIndex *index)
+{
+  GHashTableIter iter;
+  GArray *list;
+
+  g_hash_table_iter_init(&iter, index->postings);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *) &list)) {
+    guint i;
+    guint kept = 0;
+
+    for(i = 0; i < list->len; i++) {
+      guint32 id = g_array_index(list, guint32, i);
+
+      if(g_hash_table_contains(index->documents, GUINT_TO_POINTER(id)))
+        g_array_index(list, guint32, kept++) = id;
+    }
+
+    if(kept == 0)
+      g_hash_table_iter_remove(&iter);
+    else
+      g_array_set_size(list, kept);
+  }
+
+  index->posting_count -= index->stale_count;
+  index->stale_count = 0;
+}
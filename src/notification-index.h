@@ -0,0 +1,24 @@
+/*
+ * notification-index.h - A trigram index for searching notifications.
+ */
+
+#ifndef __NOTIFICATION_INDEX_H__
+#define __NOTIFICATION_INDEX_H__
+
+#include <glib.h>
+
+#include "notification.h"
+
+G_BEGIN_DECLS
+
+typedef struct _NotificationIndex NotificationIndex;
+
+NotificationIndex *notification_index_new(void);
+void               notification_index_free(NotificationIndex *index);
+void               notification_index_add(NotificationIndex *index, gpointer key, Notification *note);
+void               notification_index_remove(NotificationIndex *index, gpointer key);
+GHashTable        *notification_index_search(NotificationIndex *index, const gchar *query);
+
+G_END_DECLS
+
+#endif /* __NOTIFICATION_INDEX_H__ */
@@ -0,0 +1,174 @@
+/*
+ * notification-markup.c - Functions for rendering notifications as Pango markup.
+ *
+ * Nothing in here touches GTK, so the markup can be rendered from the GDBus
+ * worker thread before the notification reaches the main loop.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <glib/gi18n-lib.h>
+#include "notification-markup.h"
+#include "urlregex.h"
+
+static void append_body(GString *str, const gchar *body, gsize length);
+static void append_escaped(GString *str, const gchar *text, gsize length);
+
+/* Room for the tags around the text, and some for escaping and anchors */
+#define MARKUP_EXTRA_LENGTH 96
+
+/**
+ * notification_markup_new:
+ * @note: the notification
+ *
+ * Renders the markup used to display the notification, with any links within
+ * the body marked up as anchors. Everything is escaped straight into a single
+ * string sized for the whole label.
+ *
+ * Returns: the markup, free with g_free().
+ **/
+gchar *
+notification_markup_new(Notification *note)
+{
+  g_return_val_if_fail(note != NULL, NULL);
+  const gchar *app_name = notification_get_app_name(note);
+  const gchar *summary = notification_get_summary(note);
+  const gchar *body = notification_get_body(note);
+  const gchar *from = _("from");
+  gchar *timestamp_string = notification_timestamp_for_locale(note);
+
+  gsize app_name_length = strlen(app_name);
+  gsize summary_length = strlen(summary);
+  gsize body_length = strlen(body);
+  gsize timestamp_length = strlen(timestamp_string);
+
+  GString *markup = g_string_sized_new(app_name_length + summary_length + body_length +
+                                       timestamp_length + strlen(from) + MARKUP_EXTRA_LENGTH);
+
+  g_string_append(markup, "<b>");
+  append_escaped(markup, summary, summary_length);
+  g_string_append(markup, "</b>\n");
+  append_body(markup, body, body_length);
+  g_string_append(markup, "\n<small><i>");
+  append_escaped(markup, timestamp_string, timestamp_length);
+  g_string_append_c(markup, ' ');
+  g_string_append(markup, from);
+  g_string_append(markup, " <b>");
+  append_escaped(markup, app_name, app_name_length);
+  g_string_append(markup, "</b></i></small>");
+
+  g_free(timestamp_string);
+
+  return g_string_free(markup, FALSE);
+}
+
+/**
+ * append_body:
+ * @str: the string to append to
+ * @body: the body of a notification
+ * @length: the length of @body in bytes
+ *
+ * Scans through the body text escaping everything that isn't a link. The links
+ * are marked up as anchors with hrefs.
+ **/
+static void
+append_body(GString *str, const gchar *body, gsize length)
+{
+  GArray *spans = urlregex_get_spans();
+  guint i;
+
+  urlregex_find_spans(body, length, spans);
+
+  for (i = 0; i < spans->len; i++) {
+    const MatchSpan *span = &g_array_index(spans, MatchSpan, i);
+
+    if (span->kind != MATCH_NONE) {
+      const gchar *target;
+      gsize target_length;
+      const gchar *prefix = urlregex_span_href(body, span, &target, &target_length);
+
+      g_string_append(str, "<a href=\"");
+      g_string_append(str, prefix);
+      append_escaped(str, target, target_length);
+      g_string_append(str, "\">");
+      append_escaped(str, body + span->offset, span->length);
+      g_string_append(str, "</a>");
+    }
+    else {
+      append_escaped(str, body + span->offset, span->length);
+    }
+  }
+}
+
+/**
+ * append_escaped:
+ * @str: the string to append to
+ * @text: the text to escape
+ * @length: the length of @text in bytes
+ *
+ * Appends the text escaped for use in markup, the same way as
+ * g_markup_escape_text() but without a string of its own. The runs of text
+ * that need no escaping are appended in one go.
+ **/
+static void
+append_escaped(GString *str, const gchar *text, gsize length)
+{
+  const gchar *end = text + length;
+  const gchar *run = text;
+  const gchar *p;
+
+  for (p = text; p < end; p++) {
+    guchar c = *p;
+    const gchar *entity = NULL;
+    guint code;
+
+    switch (c) {
+      case '&':
+        entity = "&amp;";
+        break;
+      case '<':
+        entity = "&lt;";
+        break;
+      case '>':
+        entity = "&gt;";
+        break;
+      case '\'':
+        entity = "&apos;";
+        break;
+      case '"':
+        entity = "&quot;";
+        break;
+      default:
+        if ((c >= 0x1 && c <= 0x8) || (c >= 0xb && c <= 0xc) ||
+            (c >= 0xe && c <= 0x1f) || c == 0x7f) {
+          code = c;
+        }
+        /* The C1 control characters apart from NEL, which are two bytes */
+        else if (c == 0xc2 && p + 1 < end && (guchar) p[1] >= 0x80 &&
+                 (guchar) p[1] <= 0x9f && (guchar) p[1] != 0x85) {
+          code = (guchar) p[1];
+        }
+        else {
+          continue;
+        }
+    }
+
+    g_string_append_len(str, run, p - run);
+
+    if (entity != NULL) {
+      g_string_append(str, entity);
+    }
+    else {
+      g_string_append_printf(str, "&#x%x;", code);
+      if (code >= 0x80)
+        p++;
+    }
+
+    run = p + 1;
+  }
+
+  g_string_append_len(str, run, end - run);
+}
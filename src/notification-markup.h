@@ -0,0 +1,17 @@
+/*
+ * notification-markup.h - Functions for rendering notifications as Pango markup.
+ */
+
+#ifndef __NOTIFICATION_MARKUP_H__
+#define __NOTIFICATION_MARKUP_H__
+
+#include <glib.h>
+#include "notification.h"
+
+G_BEGIN_DECLS
+
+gchar *notification_markup_new(Notification *note);
+
+G_END_DECLS
+
+#endif /* __NOTIFICATION_MARKUP_H__ */
@@ -8,7 +8,7 @@
 
 #include <glib/gi18n-lib.h>
 #include "notification-menuitem.h"
-#include "urlregex.h"
+#include "notification-markup.h"
 
 #define NOTIFICATION_MENUITEM_MAX_CHARS 42
 #define NOTIFICATION_MENUITEM_CLOSE_SELECT "indicator-notification-close-select"
@@ -31,7 +31,6 @@ static void     notification_menuitem_select(GtkMenuItem *item);
 static void     notification_menuitem_deselect(GtkMenuItem *item);
 
 static gboolean notification_menuitem_activate_link_cb(GtkLabel *label, gchar *uri, gpointer user_data);
-static gchar   *notification_menuitem_markup_body(const gchar *body);
 
 static gboolean widget_contains_event(GtkWidget *widget, GdkEventButton *event);
 
@@ -55,9 +54,6 @@ notification_menuitem_class_init(NotificationMenuItemClass *klass)
   menu_item_class->select = notification_menuitem_select;
   menu_item_class->deselect = notification_menuitem_deselect;
 
-  /* Compile the urlregex patterns */
-  urlregex_init();
-
   notification_menuitem_signals[CLICKED] =
     g_signal_new(NOTIFICATION_MENUITEM_SIGNAL_CLICKED,
                  G_TYPE_FROM_CLASS(klass),
@@ -112,30 +108,49 @@ notification_menuitem_new(void)
  *
  * Sets the markup in the notification menuitem to display information about
  * the notification, as well as marking any links within the message body.
+ * Notifications from the DBusSpy already carry their markup, so this only
+ * renders it when it is missing. Repeated notifications get a count in front.
+ * It can be called again to update the menuitem in place.
  **/
 void
 notification_menuitem_set_from_notification(NotificationMenuItem *self, Notification *note)
 {
-  g_return_if_fail(IS_NOTIFICATION(note));
-  gchar *unescaped_timestamp_string = notification_timestamp_for_locale(note);
-
-  gchar *app_name = g_markup_escape_text(notification_get_app_name(note), -1);
-  gchar *summary = g_markup_escape_text(notification_get_summary(note), -1);
-  gchar *body = notification_menuitem_markup_body(notification_get_body(note));
-  gchar *timestamp_string = g_markup_escape_text(unescaped_timestamp_string, -1);
+  g_return_if_fail(IS_NOTIFICATION_MENUITEM(self));
+  g_return_if_fail(note != NULL);
+  const gchar *markup = notification_get_markup(note);
+  guint32 repeat_count = notification_get_repeat_count(note);
+  gchar *rendered = NULL;
+  gchar *counted = NULL;
 
-  gchar *markup = g_strdup_printf("<b>%s</b>\n%s\n<small><i>%s %s <b>%s</b></i></small>",
-      summary, body, timestamp_string, _("from"), app_name);
+  if (markup == NULL)
+    markup = rendered = notification_markup_new(note);
 
-  g_free(app_name);
-  g_free(summary);
-  g_free(body);
-  g_free(unescaped_timestamp_string);
-  g_free(timestamp_string);
+  if (repeat_count > 1)
+    markup = counted = g_strdup_printf("<small><b>\u00d7%u</b></small> %s", repeat_count, markup);
 
   gtk_label_set_markup(GTK_LABEL(self->priv->label), markup);
 
-  g_free(markup);
+  g_free(rendered);
+  g_free(counted);
+}
+
+/**
+ * notification_menuitem_reset:
+ * @self - the notification menuitem
+ *
+ * Clears the label and any pointer state, so that a detached menuitem
+ * can be reused with notification_menuitem_set_from_notification().
+ **/
+void
+notification_menuitem_reset(NotificationMenuItem *self)
+{
+  g_return_if_fail(IS_NOTIFICATION_MENUITEM(self));
+
+  self->priv->pressed_close_image = FALSE;
+  gtk_image_set_from_icon_name(GTK_IMAGE(self->priv->close_image),
+      NOTIFICATION_MENUITEM_CLOSE_DESELECT,
+      GTK_ICON_SIZE_MENU);
+  gtk_label_set_text(GTK_LABEL(self->priv->label), "");
 }
 
 /**
@@ -333,44 +348,6 @@ notification_menuitem_activate_link_cb(GtkLabel *label, gchar *uri, gpointer use
   return TRUE;
 }
 
-/**
- * notification_menuitem_markup_body:
- * @body - the body of a notification
- *
- * Scans through the body text escaping everything that isn't a link. The links
- * are marked up as anchors with hrefs.
- **/
-static gchar *
-notification_menuitem_markup_body(const gchar *body)
-{
-  GList *list = urlregex_split_all(body);
-  guint len = g_list_length(list);
-  gchar **str_array = g_new0(gchar *, len + 1);
-  guint i = 0;
-  GList *item;
-  gchar *escaped_text;
-  gchar *escaped_expanded;
-
-  for (item = list; item; item = item->next, i++) {
-    MatchGroup *group = (MatchGroup *)item->data;
-    if (group->type == MATCHED) {
-      escaped_text = g_markup_escape_text(group->text, -1);
-      escaped_expanded = g_markup_escape_text(group->expanded, -1);
-      str_array[i] = g_strdup_printf("<a href=\"%s\">%s</a>", escaped_expanded, escaped_text);
-      g_free(escaped_text);
-      g_free(escaped_expanded);
-    }
-    else {
-      str_array[i] = g_markup_escape_text(group->text, -1);
-    }
-  }
-
-  urlregex_matchgroup_list_free(list);
-  gchar *result = g_strjoinv(NULL, str_array);
-  g_strfreev(str_array);
-  return result;
-}
-
 /**
  * widget_contains_event:
  * @widget - the widget
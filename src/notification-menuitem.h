@@ -46,6 +46,7 @@ struct _NotificationMenuItemPrivate {
 GType      notification_menuitem_get_type(void);
 GtkWidget *notification_menuitem_new(void);
 void       notification_menuitem_set_from_notification(NotificationMenuItem *self, Notification *note);
+void       notification_menuitem_reset(NotificationMenuItem *self);
 
 G_END_DECLS
 
@@ -0,0 +1,654 @@
+/*
+ * notification-store.c - The notifications shown by the indicator, newest first.
+ *
+ * Each notification is stored with an item, which identifies the entry even
+ * after its notification is replaced. The newest max_visible entries are
+ * visible, the rest are hidden until a visible one is removed. Entries are
+ * kept in a queue with a pointer to the last visible one, and indexed by item
+ * and by the id the notification daemon assigned, so adding, removing,
+ * replacing and finding an entry take O(1) regardless of the number of
+ * entries. Searching, clearing, resizing the window and the foreach functions
+ * walk the queue. The text of every entry is also kept in a search index, and
+ * the newest entry with each content hash is kept to find repeated
+ * notifications.
+ */
+
+#include "notification-index.h"
+#include "notification-store.h"
+
+/* Entries whose id still isn't known after this many newer ones won't be found by id */
+#define UNINDEXED_MAX 32
+
+typedef struct {
+  /* Links in the entries and unindexed queues, their data is the entry */
+  GList         link;
+  GList         unindexed_link;
+
+  Notification *note;
+  gpointer      item;
+
+  /* The id the entry is indexed under. Once replaced it keeps the old id until
+   * the id of the new notification is known */
+  guint32       indexed_id;
+  gboolean      unindexed;
+  gboolean      visible;
+} Entry;
+
+struct _NotificationStore {
+  GQueue          entries;
+  GList          *last_visible;
+  guint           visible_length;
+  guint           max_visible;
+  guint           capacity;
+  GDestroyNotify  item_destroy;
+
+  GHashTable     *by_item;
+  GHashTable     *by_id;
+
+  /* The number of entries by app name, which is interned */
+  GHashTable     *app_lengths;
+
+  /* The newest entry by the content hash of its notification */
+  GHashTable     *by_hash;
+
+  /* Entries pushed before the daemon's reply with their id arrived */
+  GQueue          unindexed;
+
+  /* The text of the entries by item */
+  NotificationIndex *search_index;
+};
+
+static void entry_index(NotificationStore *store, Entry *entry);
+static void entry_free(NotificationStore *store, Entry *entry);
+static void app_length_add(NotificationStore *store, Notification *note, gint delta);
+static void entry_unhash(NotificationStore *store, Entry *entry);
+
+/**
+ * notification_store_new:
+ * @max_visible: the number of visible entries
+ * @capacity: the number of entries kept, visible or hidden
+ * @item_destroy: (nullable): called on the item of each entry that is dropped
+ *
+ * Creates an empty store.
+ **/
+NotificationStore *
+notification_store_new(guint max_visible, guint capacity, GDestroyNotify item_destroy)
+{
+  NotificationStore *store = g_new0(NotificationStore, 1);
+
+  g_queue_init(&store->entries);
+  g_queue_init(&store->unindexed);
+  store->max_visible = MAX(max_visible, 1);
+  store->capacity = MAX(capacity, store->max_visible);
+  store->item_destroy = item_destroy;
+  store->by_item = g_hash_table_new(g_direct_hash, g_direct_equal);
+  store->by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+  store->app_lengths = g_hash_table_new(g_direct_hash, g_direct_equal);
+  store->by_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+  store->search_index = notification_index_new();
+
+  return store;
+}
+
+/**
+ * notification_store_free:
+ * @store: the store
+ *
+ * Drops every entry and frees the store.
+ **/
+void
+notification_store_free(NotificationStore *store)
+{
+  g_return_if_fail(store != NULL);
+
+  notification_store_clear(store);
+  g_hash_table_unref(store->by_item);
+  g_hash_table_unref(store->by_id);
+  g_hash_table_unref(store->app_lengths);
+  g_hash_table_unref(store->by_hash);
+  notification_index_free(store->search_index);
+  g_free(store);
+}
+
+/**
+ * notification_store_push:
+ * @store: the store
+ * @note: the notification
+ * @item: the item to find it by, the store takes ownership
+ *
+ * Adds a visible entry in front of all others, hiding the last visible entry
+ * if the window is full. The oldest hidden entries are dropped once the store
+ * is over capacity.
+ **/
+void
+notification_store_push(NotificationStore *store, Notification *note, gpointer item)
+{
+  g_return_if_fail(store != NULL);
+  g_return_if_fail(note != NULL);
+  g_return_if_fail(item != NULL);
+  Entry *entry = g_new0(Entry, 1);
+
+  entry->link.data = entry;
+  entry->unindexed_link.data = entry;
+  entry->note = notification_ref(note);
+  entry->item = item;
+  entry->visible = TRUE;
+
+  g_queue_push_head_link(&store->entries, &entry->link);
+  g_hash_table_insert(store->by_item, item, entry);
+  entry_index(store, entry);
+  app_length_add(store, note, 1);
+  g_hash_table_insert(store->by_hash, GUINT_TO_POINTER(notification_get_content_hash(note)), entry);
+  notification_index_add(store->search_index, item, note);
+
+  if(store->visible_length < store->max_visible) {
+    store->visible_length++;
+    if(store->last_visible == NULL)
+      store->last_visible = &entry->link;
+  }
+  else {
+    /* The window is full, so its last entry becomes hidden */
+    Entry *last = store->last_visible->data;
+    last->visible = FALSE;
+    store->last_visible = store->last_visible->prev;
+  }
+
+  while(store->entries.length > store->capacity)
+    entry_free(store, g_queue_pop_tail_link(&store->entries)->data);
+}
+
+/**
+ * notification_store_remove:
+ * @store: the store
+ * @item: the item of the entry to remove
+ *
+ * Removes an entry. Removing a visible entry makes the newest hidden entry, if
+ * any, the last visible one.
+ *
+ * Returns: FALSE if there was no entry for @item.
+ **/
+gboolean
+notification_store_remove(NotificationStore *store, gpointer item)
+{
+  g_return_val_if_fail(store != NULL, FALSE);
+  Entry *entry = g_hash_table_lookup(store->by_item, item);
+
+  if(entry == NULL)
+    return FALSE;
+
+  if(entry->visible) {
+    if(store->last_visible == &entry->link)
+      store->last_visible = entry->link.prev;
+    store->visible_length--;
+  }
+
+  g_queue_unlink(&store->entries, &entry->link);
+
+  /* Promote the newest hidden entry */
+  if(entry->visible && store->entries.length > store->visible_length) {
+    GList *next = store->last_visible != NULL ? store->last_visible->next : store->entries.head;
+    Entry *promoted = next->data;
+
+    promoted->visible = TRUE;
+    store->last_visible = next;
+    store->visible_length++;
+  }
+
+  entry_free(store, entry);
+
+  return TRUE;
+}
+
+/**
+ * notification_store_replace:
+ * @store: the store
+ * @item: the item of the entry
+ * @note: the notification replacing the one in the entry
+ *
+ * Changes the notification of an entry in place. The entry is found by the id
+ * of @note once that is known, and by the id it had until then.
+ **/
+void
+notification_store_replace(NotificationStore *store, gpointer item, Notification *note)
+{
+  g_return_if_fail(store != NULL);
+  g_return_if_fail(note != NULL);
+  Entry *entry = g_hash_table_lookup(store->by_item, item);
+
+  g_return_if_fail(entry != NULL);
+
+  app_length_add(store, entry->note, -1);
+  app_length_add(store, note, 1);
+  entry_unhash(store, entry);
+
+  notification_ref(note);
+  notification_unref(entry->note);
+  entry->note = note;
+
+  entry_index(store, entry);
+
+  g_hash_table_insert(store->by_hash, GUINT_TO_POINTER(notification_get_content_hash(note)), entry);
+
+  notification_index_add(store->search_index, item, note);
+}
+
+/**
+ * notification_store_clear:
+ * @store: the store
+ *
+ * Drops every entry.
+ **/
+void
+notification_store_clear(NotificationStore *store)
+{
+  g_return_if_fail(store != NULL);
+  GList *link;
+
+  while((link = g_queue_pop_head_link(&store->entries)) != NULL)
+    entry_free(store, link->data);
+
+  store->last_visible = NULL;
+  store->visible_length = 0;
+}
+
+/**
+ * notification_store_foreach_visible:
+ * @store: the store
+ * @func: called with the item of each visible entry, newest first
+ * @user_data: passed to @func
+ *
+ * Calls @func for every visible entry. The store must not be changed by @func.
+ **/
+void
+notification_store_foreach_visible(NotificationStore *store, GFunc func, gpointer user_data)
+{
+  g_return_if_fail(store != NULL);
+  GList *link;
+  guint i;
+
+  for(link = store->entries.head, i = 0; i < store->visible_length; link = link->next, i++)
+    func(((Entry *) link->data)->item, user_data);
+}
+
+/**
+ * notification_store_foreach_notification:
+ * @store: the store
+ * @func: called with the notification of each entry, oldest first
+ * @user_data: passed to @func
+ *
+ * Calls @func for every entry, visible or hidden. The store must not be
+ * changed by @func.
+ **/
+void
+notification_store_foreach_notification(NotificationStore *store, GFunc func, gpointer user_data)
+{
+  g_return_if_fail(store != NULL);
+  GList *link;
+
+  for(link = store->entries.tail; link != NULL; link = link->prev)
+    func(((Entry *) link->data)->note, user_data);
+}
+
+/**
+ * notification_store_foreach_app:
+ * @store: the store
+ * @app_name: the application name
+ * @limit: the maximum number of times to call @func
+ * @func: called with the item of each entry from the application, newest first
+ * @user_data: passed to @func
+ *
+ * Calls @func for the entries, visible or hidden, whose notification is from
+ * the application. The store must not be changed by @func.
+ **/
+void
+notification_store_foreach_app(NotificationStore *store, const gchar *app_name, guint limit,
+                               GFunc func, gpointer user_data)
+{
+  g_return_if_fail(store != NULL);
+  g_return_if_fail(app_name != NULL);
+  gchar *interned = g_ref_string_new_intern(app_name);
+  guint remaining = MIN(GPOINTER_TO_UINT(g_hash_table_lookup(store->app_lengths, interned)), limit);
+  GList *link;
+
+  /* App names are interned, so comparing the pointers is enough */
+  for(link = store->entries.head; link != NULL && remaining > 0; link = link->next) {
+    Entry *entry = link->data;
+
+    if(notification_get_app_name(entry->note) == interned) {
+      func(entry->item, user_data);
+      remaining--;
+    }
+  }
+
+  g_ref_string_release(interned);
+}
+
+/**
+ * notification_store_get_app_length:
+ * @store: the store
+ * @app_name: the application name
+ *
+ * Returns: the number of entries, visible or hidden, from the application.
+ **/
+guint
+notification_store_get_app_length(NotificationStore *store, const gchar *app_name)
+{
+  g_return_val_if_fail(store != NULL, 0);
+  gchar *interned = g_ref_string_new_intern(app_name);
+  guint length = GPOINTER_TO_UINT(g_hash_table_lookup(store->app_lengths, interned));
+
+  g_ref_string_release(interned);
+
+  return length;
+}
+
+/**
+ * notification_store_search:
+ * @store: the store
+ * @query: the words to look for, separated by whitespace
+ * @limit: the maximum number of times to call @func
+ * @func: called with the item of each matching entry, newest first
+ * @user_data: passed to @func
+ *
+ * Calls @func for the entries, visible or hidden, whose app name, summary or
+ * body contain every word of the query, ignoring case. The store must not be
+ * changed by @func.
+ *
+ * Returns: the number of matching entries, which can be more than @limit.
+ **/
+guint
+notification_store_search(NotificationStore *store, const gchar *query, guint limit,
+                          GFunc func, gpointer user_data)
+{
+  g_return_val_if_fail(store != NULL, 0);
+  g_return_val_if_fail(query != NULL, 0);
+  GHashTable *matches = notification_index_search(store->search_index, query);
+  guint count = g_hash_table_size(matches);
+  guint found = 0;
+  GList *link;
+
+  for(link = store->entries.head; link != NULL && found < MIN(count, limit); link = link->next) {
+    Entry *entry = link->data;
+
+    if(g_hash_table_contains(matches, entry->item)) {
+      func(entry->item, user_data);
+      found++;
+    }
+  }
+
+  g_hash_table_unref(matches);
+
+  return count;
+}
+
+/**
+ * notification_store_lookup_id:
+ * @store: the store
+ * @id: the id assigned by the notification daemon
+ *
+ * Finds the entry with the given id, first indexing the entries whose id has
+ * arrived since they were pushed.
+ *
+ * Returns: (transfer none): the item of the entry, or NULL.
+ **/
+gpointer
+notification_store_lookup_id(NotificationStore *store, guint32 id)
+{
+  g_return_val_if_fail(store != NULL, NULL);
+  GList *link = store->unindexed.head;
+  Entry *entry;
+
+  while(link != NULL) {
+    GList *next = link->next;
+    entry = link->data;
+
+    if(notification_get_id(entry->note) != 0)
+      entry_index(store, entry);
+
+    link = next;
+  }
+
+  entry = g_hash_table_lookup(store->by_id, GUINT_TO_POINTER(id));
+
+  return entry != NULL ? entry->item : NULL;
+}
+
+/**
+ * notification_store_lookup_duplicate:
+ * @store: the store
+ * @note: a notification
+ *
+ * Finds the newest entry holding a notification with the same content as
+ * @note, without comparing it against every entry.
+ *
+ * Returns: (transfer none): the item of the entry, or NULL if there is none.
+ **/
+gpointer
+notification_store_lookup_duplicate(NotificationStore *store, Notification *note)
+{
+  g_return_val_if_fail(store != NULL, NULL);
+  g_return_val_if_fail(note != NULL, NULL);
+  Entry *entry = g_hash_table_lookup(store->by_hash, GUINT_TO_POINTER(notification_get_content_hash(note)));
+
+  /* A different notification with the same hash is not a repeat */
+  if(entry == NULL || !notification_same_content(entry->note, note))
+    return NULL;
+
+  return entry->item;
+}
+
+/**
+ * notification_store_get_notification:
+ * @store: the store
+ * @item: the item of the entry
+ *
+ * Returns: (transfer none): the notification of the entry, or NULL.
+ **/
+Notification *
+notification_store_get_notification(NotificationStore *store, gpointer item)
+{
+  g_return_val_if_fail(store != NULL, NULL);
+  Entry *entry = g_hash_table_lookup(store->by_item, item);
+
+  return entry != NULL ? entry->note : NULL;
+}
+
+/**
+ * notification_store_is_visible:
+ * @store: the store
+ * @item: the item of the entry
+ *
+ * Returns: TRUE if the entry is in the visible window.
+ **/
+gboolean
+notification_store_is_visible(NotificationStore *store, gpointer item)
+{
+  g_return_val_if_fail(store != NULL, FALSE);
+  Entry *entry = g_hash_table_lookup(store->by_item, item);
+
+  return entry != NULL && entry->visible;
+}
+
+/**
+ * notification_store_set_max_visible:
+ * @store: the store
+ * @max_visible: the number of visible entries
+ * @func: (nullable): called with the item of each entry that is hidden or
+ *   shown, after the store is updated for it
+ * @user_data: passed to @func
+ *
+ * Resizes the visible window. Shrinking hides the oldest visible entries,
+ * growing shows the newest hidden ones, so only the entries at the edge of
+ * the window are visited. @func can tell which way an entry moved with
+ * notification_store_is_visible(), and must not change the store.
+ **/
+void
+notification_store_set_max_visible(NotificationStore *store, guint max_visible, GFunc func, gpointer user_data)
+{
+  g_return_if_fail(store != NULL);
+  Entry *entry;
+
+  store->max_visible = MAX(max_visible, 1);
+  store->capacity = MAX(store->capacity, store->max_visible);
+
+  while(store->visible_length > store->max_visible) {
+    entry = store->last_visible->data;
+    entry->visible = FALSE;
+    store->last_visible = store->last_visible->prev;
+    store->visible_length--;
+
+    if(func != NULL)
+      func(entry->item, user_data);
+  }
+
+  while(store->visible_length < store->max_visible && store->entries.length > store->visible_length) {
+    store->last_visible = store->last_visible != NULL ? store->last_visible->next : store->entries.head;
+    entry = store->last_visible->data;
+    entry->visible = TRUE;
+    store->visible_length++;
+
+    if(func != NULL)
+      func(entry->item, user_data);
+  }
+}
+
+/**
+ * notification_store_set_capacity:
+ * @store: the store
+ * @capacity: the number of entries kept, visible or hidden
+ *
+ * Changes the capacity, dropping the oldest hidden entries that no longer fit.
+ * The capacity never drops below the number of visible entries.
+ **/
+void
+notification_store_set_capacity(NotificationStore *store, guint capacity)
+{
+  g_return_if_fail(store != NULL);
+
+  store->capacity = MAX(capacity, store->max_visible);
+
+  while(store->entries.length > store->capacity)
+    entry_free(store, g_queue_pop_tail_link(&store->entries)->data);
+}
+
+guint
+notification_store_get_length(NotificationStore *store)
+{
+  g_return_val_if_fail(store != NULL, 0);
+
+  return store->entries.length;
+}
+
+guint
+notification_store_get_visible_length(NotificationStore *store)
+{
+  g_return_val_if_fail(store != NULL, 0);
+
+  return store->visible_length;
+}
+
+/**
+ * entry_index:
+ * @store: the store
+ * @entry: the entry
+ *
+ * Indexes the entry by the id of its notification, or keeps it aside with
+ * the other unindexed entries until the id is known. An entry that is already
+ * indexed under another id stays findable by it until then.
+ **/
+static void
+entry_index(NotificationStore *store, Entry *entry)
+{
+  guint32 id = notification_get_id(entry->note);
+  gpointer old_key = GUINT_TO_POINTER(entry->indexed_id);
+
+  if(entry->unindexed) {
+    g_queue_unlink(&store->unindexed, &entry->unindexed_link);
+    entry->unindexed = FALSE;
+  }
+
+  if(id != 0) {
+    if(entry->indexed_id != 0 && entry->indexed_id != id
+        && g_hash_table_lookup(store->by_id, old_key) == entry)
+      g_hash_table_remove(store->by_id, old_key);
+
+    g_hash_table_insert(store->by_id, GUINT_TO_POINTER(id), entry);
+    entry->indexed_id = id;
+    return;
+  }
+
+  g_queue_push_head_link(&store->unindexed, &entry->unindexed_link);
+  entry->unindexed = TRUE;
+
+  /* Keep only a reasonable number */
+  if(store->unindexed.length > UNINDEXED_MAX) {
+    Entry *oldest = g_queue_pop_tail_link(&store->unindexed)->data;
+    oldest->unindexed = FALSE;
+  }
+}
+
+/**
+ * entry_free:
+ * @store: the store
+ * @entry: an entry already unlinked from the entries queue
+ *
+ * Removes the entry from the indexes and frees it.
+ **/
+static void
+entry_free(NotificationStore *store, Entry *entry)
+{
+  gpointer key = GUINT_TO_POINTER(entry->indexed_id);
+
+  if(entry->indexed_id != 0 && g_hash_table_lookup(store->by_id, key) == entry)
+    g_hash_table_remove(store->by_id, key);
+
+  if(entry->unindexed)
+    g_queue_unlink(&store->unindexed, &entry->unindexed_link);
+
+  g_hash_table_remove(store->by_item, entry->item);
+  app_length_add(store, entry->note, -1);
+  entry_unhash(store, entry);
+  notification_index_remove(store->search_index, entry->item);
+
+  if(store->item_destroy != NULL)
+    store->item_destroy(entry->item);
+  notification_unref(entry->note);
+  g_free(entry);
+}
+
+/**
+ * app_length_add:
+ * @store: the store
+ * @note: a notification
+ * @delta: the change in the number of entries
+ *
+ * Counts entries being added or removed for the application of the notification.
+ **/
+static void
+app_length_add(NotificationStore *store, Notification *note, gint delta)
+{
+  gpointer key = (gpointer) notification_get_app_name(note);
+  guint length = GPOINTER_TO_UINT(g_hash_table_lookup(store->app_lengths, key)) + delta;
+
+  if(length == 0)
+    g_hash_table_remove(store->app_lengths, key);
+  else
+    g_hash_table_insert(store->app_lengths, key, GUINT_TO_POINTER(length));
+}
+
+/**
+ * entry_unhash:
+ * @store: the store
+ * @entry: the entry
+ *
+ * Forgets the entry as the newest one with the content hash of its
+ * notification, if it still is.
+ **/
+static void
+entry_unhash(NotificationStore *store, Entry *entry)
+{
+  gpointer key = GUINT_TO_POINTER(notification_get_content_hash(entry->note));
+
+  if(g_hash_table_lookup(store->by_hash, key) == entry)
+    g_hash_table_remove(store->by_hash, key);
+}
@@ -0,0 +1,42 @@
+/*
+ * notification-store.h - The notifications shown by the indicator, newest first.
+ */
+
+#ifndef __NOTIFICATION_STORE_H__
+#define __NOTIFICATION_STORE_H__
+
+#include <glib.h>
+
+#include "notification.h"
+
+G_BEGIN_DECLS
+
+typedef struct _NotificationStore NotificationStore;
+
+NotificationStore *notification_store_new(guint max_visible, guint capacity, GDestroyNotify item_destroy);
+void               notification_store_free(NotificationStore *store);
+void               notification_store_push(NotificationStore *store, Notification *note, gpointer item);
+gboolean           notification_store_remove(NotificationStore *store, gpointer item);
+void               notification_store_replace(NotificationStore *store, gpointer item, Notification *note);
+void               notification_store_clear(NotificationStore *store);
+void               notification_store_foreach_visible(NotificationStore *store, GFunc func, gpointer user_data);
+void               notification_store_foreach_notification(NotificationStore *store, GFunc func,
+                                                           gpointer user_data);
+void               notification_store_foreach_app(NotificationStore *store, const gchar *app_name, guint limit,
+                                                  GFunc func, gpointer user_data);
+guint              notification_store_get_app_length(NotificationStore *store, const gchar *app_name);
+guint              notification_store_search(NotificationStore *store, const gchar *query, guint limit,
+                                             GFunc func, gpointer user_data);
+gpointer           notification_store_lookup_id(NotificationStore *store, guint32 id);
+gpointer           notification_store_lookup_duplicate(NotificationStore *store, Notification *note);
+Notification      *notification_store_get_notification(NotificationStore *store, gpointer item);
+gboolean           notification_store_is_visible(NotificationStore *store, gpointer item);
+void               notification_store_set_max_visible(NotificationStore *store, guint max_visible,
+                                                      GFunc func, gpointer user_data);
+void               notification_store_set_capacity(NotificationStore *store, guint capacity);
+guint              notification_store_get_length(NotificationStore *store);
+guint              notification_store_get_visible_length(NotificationStore *store);
+
+G_END_DECLS
+
+#endif /* __NOTIFICATION_STORE_H__ */
@@ -1,206 +1,357 @@
 /*
- * notification.c - A gobject subclass to represent a org.freedesktop.Notification.Notify message.
+ * notification.c - A refcounted record of a org.freedesktop.Notification.Notify message.
  */
 
 #include <string.h>
+#include "fnv-hash.h"
 #include "notification.h"
 
-#define COLUMN_APP_NAME       0
-#define COLUMN_REPLACES_ID    1
-#define COLUMN_APP_ICON       2
-#define COLUMN_SUMMARY        3
-#define COLUMN_BODY           4
-#define COLUMN_ACTIONS        5
-#define COLUMN_HINTS          6
-#define COLUMN_EXPIRE_TIMEOUT 7
+#define X_CANONICAL_PRIVATE_SYNCHRONOUS "x-canonical-private-synchronous"
 
-#define COLUMN_COUNT 8
+/* A notification is a single allocation, with the summary and body stored
+ * after the struct. The application name and icon come from a handful of
+ * applications, so they are interned and shared between notifications. */
+struct _Notification {
+  gint         ref_count;
 
-#define X_CANONICAL_PRIVATE_SYNCHRONOUS "x-canonical-private-synchronous"
+  /* The id assigned by the notification daemon, 0 until it is known.
+   * Set from the GDBus worker thread, so it is accessed atomically. */
+  gint         id;
 
-static void notification_class_init(NotificationClass *klass);
-static void notification_init(Notification *self);
-static void notification_dispose(GObject *object);
+  guint32      replaces_id;
+  gint         expire_timeout;
 
-G_DEFINE_TYPE_WITH_PRIVATE(Notification, notification, G_TYPE_OBJECT);
+  /* Wall clock time of arrival in microseconds */
+  gint64       timestamp;
 
-static void
-notification_class_init(NotificationClass *klass)
-{
-  GObjectClass *object_class = G_OBJECT_CLASS(klass);
+  /* Interned with g_ref_string_new_intern() */
+  const gchar *app_name;
+  const gchar *app_icon;
 
-  object_class->dispose = notification_dispose;
-}
+  /* Pango markup rendered off the main loop, may be NULL */
+  gchar       *markup;
 
-static void
-notification_init(Notification *self)
-{
-  self->priv = notification_get_instance_private(self);
+  /* The record in the history file plus one, 0 if not written */
+  guint32      history_index;
 
-  self->priv->app_name = NULL;
-  self->priv->replaces_id = 0;
-  self->priv->app_icon = NULL;
-  self->priv->summary = NULL;
-  self->priv->body = NULL;
-  self->priv->expire_timeout = 0;
-  self->priv->timestamp = NULL;
-  self->priv->is_private = FALSE;
-}
+  /* Hash of the app name, summary and body, to find repeats cheaply */
+  guint32      content_hash;
 
-static void
-notification_dispose(GObject *object)
-{
-  Notification *self = NOTIFICATION(object);
+  /* How many times the same content arrived, counting this one */
+  guint32      repeat_count;
 
-  if(self->priv->app_name != NULL) {
-    g_free(self->priv->app_name);
-    self->priv->app_name = NULL;
-  }
+  guint32      summary_length;
+  guint32      body_length;
+  gboolean     is_private;
 
-  if(self->priv->app_icon != NULL) {
-    g_free(self->priv->app_icon);
-    self->priv->app_icon = NULL;
-  }
+  /* The summary and body, each nul-terminated */
+  gchar        text[];
+};
 
-  if(self->priv->summary != NULL) {
-    g_free(self->priv->summary);
-    self->priv->summary = NULL;
-  }
+static const gchar *strip_slice(const gchar *str, gsize *length);
+static Notification *notification_alloc(const gchar *app_name, const gchar *app_icon,
+                                        const gchar *summary, gsize summary_length,
+                                        const gchar *body, gsize body_length);
 
-  if(self->priv->body != NULL) {
-    g_free(self->priv->body);
-    self->priv->body = NULL;
-  }
+G_DEFINE_BOXED_TYPE(Notification, notification, notification_ref, notification_unref);
 
-  if(self->priv->timestamp != NULL) {
-    g_date_time_unref(self->priv->timestamp);
-    self->priv->timestamp = NULL;
-  }
+/**
+ * strip_slice:
+ * @str: a nul-terminated string
+ * @length: return location for the length of the stripped string
+ *
+ * Finds the part of @str left after stripping leading and trailing whitespace
+ * the same way as g_strstrip(), without modifying or copying @str.
+ *
+ * Returns: the start of the stripped string inside @str.
+ **/
+static const gchar *
+strip_slice(const gchar *str, gsize *length)
+{
+  const gchar *end;
 
-  G_OBJECT_CLASS(notification_parent_class)->dispose(object);
+  while(g_ascii_isspace(*str))
+    str++;
+
+  end = str + strlen(str);
+
+  while(end > str && g_ascii_isspace(end[-1]))
+    end--;
+
+  *length = end - str;
+  return str;
 }
 
-Notification* 
-notification_new(void)
+/**
+ * notification_alloc:
+ *
+ * Allocates a notification holding copies of the strings, with its other
+ * fields cleared. The summary and body do not have to be nul-terminated.
+ * The content hash is computed while the strings are at hand.
+ **/
+static Notification *
+notification_alloc(const gchar *app_name, const gchar *app_icon,
+                   const gchar *summary, gsize summary_length,
+                   const gchar *body, gsize body_length)
 {
-  return NOTIFICATION(g_object_new(NOTIFICATION_TYPE, NULL));
+  /* Message bodies are limited to 128 MiB, so the lengths fit */
+  Notification *self = g_malloc(sizeof(Notification) + summary_length + body_length + 2);
+
+  self->ref_count = 1;
+  self->id = 0;
+  self->replaces_id = 0;
+  self->expire_timeout = 0;
+  self->timestamp = 0;
+  self->app_name = g_ref_string_new_intern(app_name);
+  self->app_icon = g_ref_string_new_intern(app_icon);
+  self->markup = NULL;
+  self->history_index = 0;
+  self->repeat_count = 1;
+  self->is_private = FALSE;
+
+  self->summary_length = summary_length;
+  memcpy(self->text, summary, summary_length);
+  self->text[summary_length] = '\0';
+
+  self->body_length = body_length;
+  memcpy(self->text + summary_length + 1, body, body_length);
+  self->text[summary_length + 1 + body_length] = '\0';
+
+  /* The nul bytes keep the fields apart, so moving text between them changes the hash */
+  self->content_hash = fnv_hash_update(FNV_HASH_INIT, self->app_name, strlen(self->app_name) + 1);
+  self->content_hash = fnv_hash_update(self->content_hash, self->text,
+                                       summary_length + body_length + 2);
+
+  return self;
 }
 
+/**
+ * notification_new_from_dbus_message:
+ * @message: a org.freedesktop.Notifications.Notify method call
+ *
+ * Creates a notification from the body of a Notify call. The strings are
+ * copied out of the message, so it does not need to outlive the notification.
+ *
+ * Returns: the notification, or NULL if the message body is malformed.
+ **/
 Notification*
 notification_new_from_dbus_message(GDBusMessage *message)
 {
-  Notification *self = notification_new();
-
-  /* timestamp */
-  self->priv->timestamp = g_date_time_new_now_local();
-
   GVariant *body = g_dbus_message_get_body(message);
-  GVariant *child = NULL, *value = NULL;
-  g_assert(g_variant_is_of_type(body, G_VARIANT_TYPE_TUPLE));
-  g_assert(g_variant_n_children(body) == COLUMN_COUNT);
-
-  /* app_name */
-  child = g_variant_get_child_value(body, COLUMN_APP_NAME);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_STRING));
-  self->priv->app_name = g_variant_dup_string(child, 
-      &(self->priv->app_name_length));
-  g_variant_unref(child);
-
-  /* replaces_id */
-  child = g_variant_get_child_value(body, COLUMN_REPLACES_ID);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_UINT32));
-  self->priv->replaces_id = g_variant_get_uint32(child);
-  g_variant_unref(child);
-
-  /* app_icon */
-  child = g_variant_get_child_value(body, COLUMN_APP_ICON);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_STRING));
-  self->priv->app_icon = g_variant_dup_string(child,
-      &(self->priv->app_icon_length));
-  g_variant_unref(child);
-
-  /* summary */
-  child = g_variant_get_child_value(body, COLUMN_SUMMARY);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_STRING));
-  self->priv->summary = g_variant_dup_string(child,
-      &(self->priv->summary_length));
-  g_strstrip(self->priv->summary);
-  self->priv->summary_length = strlen(self->priv->summary);
-  g_variant_unref(child);
-
-  /* body */
-  child = g_variant_get_child_value(body, COLUMN_BODY);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_STRING));
-  self->priv->body = g_variant_dup_string(child,
-      &(self->priv->body_length));
-  g_strstrip(self->priv->body);
-  self->priv->body_length = strlen(self->priv->body);
-  g_variant_unref(child);
-
-  /* hints */
-  child = g_variant_get_child_value(body, COLUMN_HINTS);
-  g_assert(g_variant_is_of_type(child, G_VARIANT_TYPE_DICTIONARY));
+  GVariant *hints = NULL;
+  const gchar *app_name = NULL;
+  const gchar *app_icon = NULL;
+  const gchar *summary = NULL;
+  const gchar *body_text = NULL;
+  const gchar *private_string = NULL;
+  gsize summary_length;
+  gsize body_length;
+  guint32 replaces_id;
+  gint expire_timeout;
+
+  /* Validate the signature once, everything below relies on it */
+  if(body == NULL || !g_variant_is_of_type(body, G_VARIANT_TYPE(NOTIFICATION_NOTIFY_SIGNATURE)))
+    return NULL;
+
+  g_variant_get(body, "(&su&s&s&s@as@a{sv}i)",
+                &app_name,
+                &replaces_id,
+                &app_icon,
+                &summary,
+                &body_text,
+                NULL,
+                &hints,
+                &expire_timeout);
+
+  summary = strip_slice(summary, &summary_length);
+  body_text = strip_slice(body_text, &body_length);
+
+  Notification *self = notification_alloc(app_name, app_icon, summary, summary_length,
+                                          body_text, body_length);
+
+  self->replaces_id = replaces_id;
+  self->expire_timeout = expire_timeout;
+  self->timestamp = g_get_real_time();
 
   /* check for volume hint */
-  value = g_variant_lookup_value(child, X_CANONICAL_PRIVATE_SYNCHRONOUS, G_VARIANT_TYPE_STRING);
-  if(value != NULL) {
-    const gchar *private_string = g_variant_get_string(value, NULL);
-    g_variant_unref(value);
-    value = NULL;
-
+  if(g_variant_lookup(hints, X_CANONICAL_PRIVATE_SYNCHRONOUS, "&s", &private_string)) {
     if((g_strcmp0(private_string, "volume") == 0) ||
        (g_strcmp0(private_string, "brightness") == 0) ||
        (g_strcmp0(private_string, "indicator-sound") == 0)) {
-      self->priv->is_private = TRUE;
+      self->is_private = TRUE;
     }
   }
 
-  g_variant_unref(child);
-  child = NULL;
+  g_variant_unref(hints);
 
   return self;
 }
 
+/**
+ * notification_new_full:
+ * @app_name: the application name
+ * @app_icon: the application icon
+ * @summary: the summary, not necessarily nul-terminated
+ * @summary_length: the length of @summary
+ * @body: the body, not necessarily nul-terminated
+ * @body_length: the length of @body
+ * @timestamp: the wall clock time of arrival in microseconds
+ *
+ * Creates a notification from stored fields, such as a record in the history.
+ * The strings are copied. Its id is not known, since ids from an earlier session
+ * of the notification daemon could be assigned again.
+ *
+ * Returns: the notification.
+ **/
+Notification*
+notification_new_full(const gchar *app_name, const gchar *app_icon,
+                      const gchar *summary, gsize summary_length,
+                      const gchar *body, gsize body_length,
+                      gint64 timestamp)
+{
+  g_return_val_if_fail(app_name != NULL && app_icon != NULL, NULL);
+  g_return_val_if_fail(summary != NULL && body != NULL, NULL);
+
+  Notification *self = notification_alloc(app_name, app_icon, summary, summary_length,
+                                          body, body_length);
+
+  self->timestamp = timestamp;
+
+  return self;
+}
+
+/**
+ * notification_ref:
+ * @self: the notification
+ *
+ * Returns: @self with its reference count increased. Safe to call from any thread.
+ **/
+Notification*
+notification_ref(Notification *self)
+{
+  g_return_val_if_fail(self != NULL, NULL);
+
+  g_atomic_int_inc(&self->ref_count);
+
+  return self;
+}
+
+/**
+ * notification_unref:
+ * @self: the notification
+ *
+ * Decreases the reference count, freeing the notification when it reaches zero.
+ * Safe to call from any thread.
+ **/
+void
+notification_unref(Notification *self)
+{
+  g_return_if_fail(self != NULL);
+
+  if(!g_atomic_int_dec_and_test(&self->ref_count))
+    return;
+
+  g_ref_string_release((char *) self->app_name);
+  g_ref_string_release((char *) self->app_icon);
+  g_free(self->markup);
+  g_free(self);
+}
+
+/**
+ * notification_get_app_name:
+ * @self: the notification
+ *
+ * Returns: the application name. Names are interned, so equal names from any
+ * two notifications are the same pointer.
+ **/
 const gchar*
 notification_get_app_name(Notification *self)
 {
-  return self->priv->app_name;
+  return self->app_name;
+}
+
+guint32
+notification_get_replaces_id(Notification *self)
+{
+  return self->replaces_id;
+}
+
+/**
+ * notification_get_id:
+ * @self: the notification
+ *
+ * Returns: the id the notification daemon assigned, or 0 if it is not known yet.
+ **/
+guint32
+notification_get_id(Notification *self)
+{
+  return (guint32) g_atomic_int_get(&self->id);
+}
+
+/**
+ * notification_set_id:
+ * @self: the notification
+ * @id: the id from the reply to the Notify call
+ *
+ * Records the id the notification daemon assigned. Safe to call from any thread.
+ **/
+void
+notification_set_id(Notification *self, guint32 id)
+{
+  g_atomic_int_set(&self->id, (gint) id);
 }
 
 const gchar*
 notification_get_app_icon(Notification *self)
 {
-  return self->priv->app_icon;
+  return self->app_icon;
 }
 
 const gchar*
 notification_get_summary(Notification *self)
 {
-  return self->priv->summary;
+  return self->text;
 }
 
 const gchar*
 notification_get_body(Notification *self)
 {
-  return self->priv->body;
+  return self->text + self->summary_length + 1;
 }
 
 gint64
 notification_get_timestamp(Notification *self)
 {
-  return g_date_time_to_unix(self->priv->timestamp);
+  return self->timestamp / G_USEC_PER_SEC;
+}
+
+/**
+ * notification_get_timestamp_us:
+ * @self: the notification
+ *
+ * Returns: the wall clock time of arrival in microseconds.
+ **/
+gint64
+notification_get_timestamp_us(Notification *self)
+{
+  return self->timestamp;
 }
 
 gchar*
 notification_timestamp_for_locale(Notification *self)
 {
-  return g_date_time_format(self->priv->timestamp, "%X %x");
+  GDateTime *timestamp = g_date_time_new_from_unix_local(self->timestamp / G_USEC_PER_SEC);
+  gchar *result = g_date_time_format(timestamp, "%X %x");
+
+  g_date_time_unref(timestamp);
+
+  return result;
 }
 
 gboolean
 notification_is_private(Notification *self)
 {
-  return self->priv->is_private;
+  return self->is_private;
 }
 
 /**
@@ -210,14 +361,124 @@ notification_is_private(Notification *self)
 gboolean
 notification_is_empty(Notification *self)
 {
-  return (self->priv->summary_length == 0) && (self->priv->body_length == 0);
+  return (self->summary_length == 0) && (self->body_length == 0);
+}
+
+/**
+ * notification_get_markup:
+ * @self: the notification
+ *
+ * Returns: the pre-rendered markup, or NULL if none was set.
+ **/
+const gchar*
+notification_get_markup(Notification *self)
+{
+  return self->markup;
+}
+
+/**
+ * notification_set_markup:
+ * @self: the notification
+ * @markup: (transfer full): the rendered markup
+ *
+ * Attaches pre-rendered markup to the notification. This must happen before
+ * the notification is handed to another thread.
+ **/
+void
+notification_set_markup(Notification *self, gchar *markup)
+{
+  g_free(self->markup);
+  self->markup = markup;
+}
+
+/**
+ * notification_get_history_index:
+ * @self: the notification
+ *
+ * Returns: the index of the notification's record in the history plus one,
+ * or 0 if it has not been written.
+ **/
+guint32
+notification_get_history_index(Notification *self)
+{
+  return self->history_index;
+}
+
+/**
+ * notification_set_history_index:
+ * @self: the notification
+ * @index: the index of the record plus one, or 0
+ *
+ * Records where the history wrote the notification. Only used from the main loop.
+ **/
+void
+notification_set_history_index(Notification *self, guint32 index)
+{
+  self->history_index = index;
+}
+
+/**
+ * notification_get_content_hash:
+ * @self: the notification
+ *
+ * Returns: a hash of the application name, summary and body.
+ **/
+guint32
+notification_get_content_hash(Notification *self)
+{
+  return self->content_hash;
+}
+
+/**
+ * notification_same_content:
+ * @self: a notification
+ * @other: another notification
+ *
+ * Returns: TRUE if both notifications come from the same application with
+ * the same summary and body.
+ **/
+gboolean
+notification_same_content(Notification *self, Notification *other)
+{
+  g_return_val_if_fail(self != NULL && other != NULL, FALSE);
+
+  return self->content_hash == other->content_hash &&
+         self->app_name == other->app_name &&
+         self->summary_length == other->summary_length &&
+         self->body_length == other->body_length &&
+         memcmp(self->text, other->text, self->summary_length + self->body_length + 2) == 0;
+}
+
+/**
+ * notification_get_repeat_count:
+ * @self: the notification
+ *
+ * Returns: how many times the same notification arrived, at least 1.
+ **/
+guint32
+notification_get_repeat_count(Notification *self)
+{
+  return self->repeat_count;
+}
+
+/**
+ * notification_set_repeat_count:
+ * @self: the notification
+ * @count: how many times the same notification arrived
+ *
+ * Only used from the main loop.
+ **/
+void
+notification_set_repeat_count(Notification *self, guint32 count)
+{
+  self->repeat_count = MAX(count, 1);
 }
 
 void
 notification_print(Notification *self)
 {
-  g_print("app_name = %s\n", self->priv->app_name);
-  g_print("app_icon = %s\n", self->priv->app_icon);
-  g_print("summary = %s\n", self->priv->summary);
-  g_print("body = %s\n", self->priv->body);
+  g_print("app_name = %s\n", self->app_name);
+  g_print("app_icon = %s\n", self->app_icon);
+  g_print("summary = %s\n", notification_get_summary(self));
+  g_print("body = %s\n", notification_get_body(self));
 }
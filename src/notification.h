@@ -1,5 +1,5 @@
 /*
- * notification.h - A gobject subclass to represent a org.freedesktop.Notification.Notify message.
+ * notification.h - A refcounted record of a org.freedesktop.Notification.Notify message.
  */
 
 #ifndef __NOTIFICATION_H__
@@ -13,53 +13,41 @@
 G_BEGIN_DECLS
 
 #define NOTIFICATION_TYPE             (notification_get_type ())
-#define NOTIFICATION(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), NOTIFICATION_TYPE, Notification))
-#define NOTIFICATION_CLASS(klass)     (G_TYPE_CHECK_CLASS_CAST ((klass), NOTIFICATION_TYPE, NotificationClass))
-#define IS_NOTIFICATION(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), NOTIFICATION_TYPE))
-#define IS_NOTIFICATION_CLASS(klass)  (G_TYPE_CHECK_CLASS_TYPE ((klass), NOTIFICATION_TYPE))
 
-typedef struct _Notification        Notification;
-typedef struct _NotificationClass   NotificationClass;
-typedef struct _NotificationPrivate NotificationPrivate;
-
-struct _Notification
-{
-  GObject              parent;
-  NotificationPrivate *priv;
-};
-
-struct _NotificationClass
-{
-  GObjectClass parent_class;
-};
+/* The signature of the org.freedesktop.Notifications.Notify arguments:
+ * app_name, replaces_id, app_icon, summary, body, actions, hints, expire_timeout */
+#define NOTIFICATION_NOTIFY_SIGNATURE "(susssasa{sv}i)"
 
-struct _NotificationPrivate {
-  gchar     *app_name;
-  gsize      app_name_length;
-  guint32    replaces_id;
-  gchar     *app_icon;
-  gsize      app_icon_length;
-  gchar     *summary;
-  gsize      summary_length;
-  gchar     *body;
-  gsize      body_length;
-  gint       expire_timeout;
-  GDateTime *timestamp;
-
-  gboolean   is_private;
-};
+typedef struct _Notification        Notification;
 
 GType         notification_get_type(void);
-Notification *notification_new(void);
 Notification *notification_new_from_dbus_message(GDBusMessage *);
+Notification *notification_new_full(const gchar *app_name, const gchar *app_icon,
+                                    const gchar *summary, gsize summary_length,
+                                    const gchar *body, gsize body_length,
+                                    gint64 timestamp);
+Notification *notification_ref(Notification *);
+void          notification_unref(Notification *);
 const gchar  *notification_get_app_name(Notification *);
+guint32       notification_get_replaces_id(Notification *);
+guint32       notification_get_id(Notification *);
+void          notification_set_id(Notification *, guint32);
 const gchar  *notification_get_app_icon(Notification *);
 const gchar  *notification_get_summary(Notification *);
 const gchar  *notification_get_body(Notification *);
 gint64        notification_get_timestamp(Notification *);
+gint64        notification_get_timestamp_us(Notification *);
 gchar        *notification_timestamp_for_locale(Notification *);
 gboolean      notification_is_private(Notification *);
 gboolean      notification_is_empty(Notification *);
+const gchar  *notification_get_markup(Notification *);
+void          notification_set_markup(Notification *, gchar *);
+guint32       notification_get_history_index(Notification *);
+void          notification_set_history_index(Notification *, guint32);
+guint32       notification_get_content_hash(Notification *);
+gboolean      notification_same_content(Notification *, Notification *);
+guint32       notification_get_repeat_count(Notification *);
+void          notification_set_repeat_count(Notification *, guint32);
 void          notification_print(Notification *);
 
 G_END_DECLS
@@ -0,0 +1,260 @@
+/*
+ * notify-recording.c - Read and write recordings of Notify calls.
+ *
+ * A recording is a header followed by one record per Notify call. All
+ * integers are little-endian.
+ *
+ *   header: 8 byte magic, guint32 version, guint32 reserved
+ *   record: gint64 timestamp, guint32 size, guint32 reserved,
+ *           size bytes of serialized body, padding to 8 bytes
+ *
+ * The timestamp is the monotonic time in microseconds when the call was seen,
+ * and the body is the serialized GVariant of the call arguments in normal
+ * form. Everything is 8-byte aligned, so a mapped recording can be read
+ * without copying the bodies.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include "notify-recording.h"
+#include "notification.h"
+
+#define RECORDING_MAGIC   "NOTIFREC"
+#define RECORDING_VERSION 1
+
+#define HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 16
+
+/* Buffered records are flushed at least this often, in microseconds */
+#define FLUSH_INTERVAL G_USEC_PER_SEC
+
+struct _NotifyRecorder {
+  FILE   *file;
+  gint64  last_flush;
+};
+
+struct _NotifyRecording {
+  GMappedFile *mapped;
+  const gchar *data;
+  gsize        size;
+  gsize        offset;
+};
+
+G_DEFINE_QUARK(notify-recording-error-quark, notify_recording_error)
+
+/**
+ * notify_recorder_new:
+ * @path: the file to write
+ * @error: return location for an error
+ *
+ * Creates a recorder writing to @path, replacing any existing file.
+ *
+ * Returns: the recorder, or NULL on error.
+ **/
+NotifyRecorder *
+notify_recorder_new(const gchar *path, GError **error)
+{
+  g_return_val_if_fail(path != NULL, NULL);
+  guint32 header[2] = { GUINT32_TO_LE(RECORDING_VERSION), 0 };
+  FILE *file = g_fopen(path, "wb");
+
+  if(file == NULL) {
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Could not open %s: %s", path, g_strerror(errno));
+    return NULL;
+  }
+
+  if(fwrite(RECORDING_MAGIC, 8, 1, file) != 1 || fwrite(header, sizeof(header), 1, file) != 1) {
+    g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Could not write %s: %s", path, g_strerror(errno));
+    fclose(file);
+    return NULL;
+  }
+
+  NotifyRecorder *recorder = g_new0(NotifyRecorder, 1);
+  recorder->file = file;
+  recorder->last_flush = g_get_monotonic_time();
+
+  return recorder;
+}
+
+/**
+ * notify_recorder_write:
+ * @recorder: the recorder
+ * @timestamp: the monotonic time the call was seen, in microseconds
+ * @body: the body of the Notify call
+ *
+ * Appends a record. Bodies that do not have the Notify signature could not be
+ * replayed, so they are skipped.
+ *
+ * Returns: FALSE if the record could not be written.
+ **/
+gboolean
+notify_recorder_write(NotifyRecorder *recorder, gint64 timestamp, GVariant *body)
+{
+  g_return_val_if_fail(recorder != NULL, FALSE);
+  static const gchar padding[8] = { 0 };
+  GVariant *normal;
+  guint32 size;
+  gint64 header[2];
+  gboolean ok;
+
+  if(body == NULL || !g_variant_is_of_type(body, G_VARIANT_TYPE(NOTIFICATION_NOTIFY_SIGNATURE)))
+    return TRUE;
+
+  normal = g_variant_get_normal_form(body);
+  if(G_BYTE_ORDER == G_BIG_ENDIAN) {
+    GVariant *swapped = g_variant_byteswap(normal);
+    g_variant_unref(normal);
+    normal = swapped;
+  }
+
+  size = g_variant_get_size(normal);
+  header[0] = GINT64_TO_LE(timestamp);
+  header[1] = GINT64_TO_LE((gint64) size);
+
+  ok = fwrite(header, sizeof(header), 1, recorder->file) == 1
+    && (size == 0 || fwrite(g_variant_get_data(normal), size, 1, recorder->file) == 1)
+    && (size % 8 == 0 || fwrite(padding, 8 - size % 8, 1, recorder->file) == 1);
+
+  g_variant_unref(normal);
+
+  if(ok && timestamp - recorder->last_flush >= FLUSH_INTERVAL) {
+    ok = fflush(recorder->file) == 0;
+    recorder->last_flush = timestamp;
+  }
+
+  return ok;
+}
+
+/**
+ * notify_recorder_free:
+ * @recorder: the recorder
+ *
+ * Flushes and closes the recording.
+ **/
+void
+notify_recorder_free(NotifyRecorder *recorder)
+{
+  g_return_if_fail(recorder != NULL);
+
+  fclose(recorder->file);
+  g_free(recorder);
+}
+
+/**
+ * notify_recording_open:
+ * @path: the file to read
+ * @error: return location for an error
+ *
+ * Maps a recording written by #NotifyRecorder.
+ *
+ * Returns: the recording, or NULL on error.
+ **/
+NotifyRecording *
+notify_recording_open(const gchar *path, GError **error)
+{
+  g_return_val_if_fail(path != NULL, NULL);
+  GMappedFile *mapped = g_mapped_file_new(path, FALSE, error);
+  const gchar *data;
+  gsize size;
+  guint32 version;
+
+  if(mapped == NULL)
+    return NULL;
+
+  data = g_mapped_file_get_contents(mapped);
+  size = g_mapped_file_get_length(mapped);
+
+  if(size < HEADER_SIZE || memcmp(data, RECORDING_MAGIC, 8) != 0) {
+    g_set_error(error, NOTIFY_RECORDING_ERROR, NOTIFY_RECORDING_ERROR_INVALID,
+                "%s is not a notification recording", path);
+    g_mapped_file_unref(mapped);
+    return NULL;
+  }
+
+  memcpy(&version, data + 8, sizeof(version));
+  if(GUINT32_FROM_LE(version) != RECORDING_VERSION) {
+    g_set_error(error, NOTIFY_RECORDING_ERROR, NOTIFY_RECORDING_ERROR_INVALID,
+                "%s has unsupported version %u", path, GUINT32_FROM_LE(version));
+    g_mapped_file_unref(mapped);
+    return NULL;
+  }
+
+  NotifyRecording *recording = g_new0(NotifyRecording, 1);
+  recording->mapped = mapped;
+  recording->data = data;
+  recording->size = size;
+  recording->offset = HEADER_SIZE;
+
+  return recording;
+}
+
+/**
+ * notify_recording_next:
+ * @recording: the recording
+ * @timestamp: (out): return location for the timestamp
+ * @body: (out): return location for the body, a new reference
+ *
+ * Reads the next record. The body shares its data with the mapped file. A
+ * record cut short, as by a recorder that did not exit cleanly, ends the
+ * recording.
+ *
+ * Returns: FALSE at the end of the recording.
+ **/
+gboolean
+notify_recording_next(NotifyRecording *recording, gint64 *timestamp, GVariant **body)
+{
+  g_return_val_if_fail(recording != NULL, FALSE);
+  gint64 header[2];
+  gsize size;
+
+  if(recording->size - recording->offset < RECORD_HEADER_SIZE)
+    return FALSE;
+
+  memcpy(header, recording->data + recording->offset, sizeof(header));
+  size = (gsize) GINT64_FROM_LE(header[1]);
+
+  if(size > recording->size - recording->offset - RECORD_HEADER_SIZE)
+    return FALSE;
+
+  if(timestamp != NULL)
+    *timestamp = GINT64_FROM_LE(header[0]);
+
+  if(body != NULL) {
+    GVariant *value = g_variant_new_from_data(G_VARIANT_TYPE(NOTIFICATION_NOTIFY_SIGNATURE),
+                                              recording->data + recording->offset + RECORD_HEADER_SIZE,
+                                              size, FALSE,
+                                              (GDestroyNotify) g_mapped_file_unref,
+                                              g_mapped_file_ref(recording->mapped));
+
+    if(G_BYTE_ORDER == G_BIG_ENDIAN) {
+      *body = g_variant_ref_sink(g_variant_byteswap(value));
+      g_variant_unref(g_variant_ref_sink(value));
+    }
+    else {
+      *body = g_variant_ref_sink(value);
+    }
+  }
+
+  recording->offset += RECORD_HEADER_SIZE + ((size + 7) & ~(gsize) 7);
+  recording->offset = MIN(recording->offset, recording->size);
+
+  return TRUE;
+}
+
+/**
+ * notify_recording_close:
+ * @recording: the recording
+ *
+ * Unmaps the recording. Bodies returned by notify_recording_next() stay valid.
+ **/
+void
+notify_recording_close(NotifyRecording *recording)
+{
+  g_return_if_fail(recording != NULL);
+
+  g_mapped_file_unref(recording->mapped);
+  g_free(recording);
+}
@@ -0,0 +1,33 @@
+/*
+ * notify-recording.h - Read and write recordings of Notify calls.
+ */
+
+#ifndef __NOTIFY_RECORDING_H__
+#define __NOTIFY_RECORDING_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define NOTIFY_RECORDING_ERROR (notify_recording_error_quark())
+
+typedef enum {
+  NOTIFY_RECORDING_ERROR_INVALID
+} NotifyRecordingError;
+
+typedef struct _NotifyRecorder  NotifyRecorder;
+typedef struct _NotifyRecording NotifyRecording;
+
+GQuark           notify_recording_error_quark(void);
+
+NotifyRecorder  *notify_recorder_new(const gchar *path, GError **error);
+gboolean         notify_recorder_write(NotifyRecorder *recorder, gint64 timestamp, GVariant *body);
+void             notify_recorder_free(NotifyRecorder *recorder);
+
+NotifyRecording *notify_recording_open(const gchar *path, GError **error);
+gboolean         notify_recording_next(NotifyRecording *recording, gint64 *timestamp, GVariant **body);
+void             notify_recording_close(NotifyRecording *recording);
+
+G_END_DECLS
+
+#endif /* __NOTIFY_RECORDING_H__ */
@@ -0,0 +1,290 @@
+/*
+ * notify-replay.c - Replay a recording of Notify calls on a private bus.
+ *
+ * Recordings are made by running the indicator with
+ * INDICATOR_NOTIFICATIONS_RECORD set to a file name. By default the calls are
+ * replayed on a private dbus-daemon, which also gets a minimal notification
+ * daemon so the calls have someone to answer them. A command given after the
+ * recording is started on that bus before the replay begins, e.g. a panel
+ * hosting the indicator under a profiler.
+ *
+ *   notify-replay [--speed=FACTOR] RECORDING [-- COMMAND [ARGS...]]
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <gio/gio.h>
+#include "notify-recording.h"
+#include "notify-server.h"
+
+/* Calls waiting for a reply are limited to stay below the daemon's limits */
+#define MAX_IN_FLIGHT 64
+
+/* Calls sent per main loop iteration at maximum speed */
+#define MAX_BATCH 32
+
+typedef struct {
+  NotifyRecording *recording;
+  GDBusConnection *connection;
+  GMainLoop       *loop;
+  gdouble          speed;
+
+  /* The next record to send, if already read */
+  GVariant        *next_body;
+  gint64           next_timestamp;
+  gint64           first_timestamp;
+  gint64           start_time;
+  gboolean         finished;
+  guint            source_id;
+
+  guint            in_flight;
+  guint            sent;
+  guint            replied;
+  guint            failed;
+} Replay;
+
+static gdouble   option_speed = 1.0;
+static gchar    *option_address = NULL;
+static gboolean  option_no_server = FALSE;
+static gdouble   option_delay = 1.0;
+static gchar   **option_remaining = NULL;
+
+static GOptionEntry option_entries[] = {
+  { "speed", 's', 0, G_OPTION_ARG_DOUBLE, &option_speed,
+    "Replay speed relative to the recording, 0 for as fast as possible", "FACTOR" },
+  { "address", 'a', 0, G_OPTION_ARG_STRING, &option_address,
+    "Replay on this bus instead of a private one", "ADDRESS" },
+  { "no-server", 0, 0, G_OPTION_ARG_NONE, &option_no_server,
+    "Do not answer the calls as the notification daemon", NULL },
+  { "delay", 'd', 0, G_OPTION_ARG_DOUBLE, &option_delay,
+    "Seconds to wait after starting the command", "SECONDS" },
+  { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &option_remaining,
+    NULL, "RECORDING [-- COMMAND [ARGS...]]" },
+  { NULL }
+};
+
+static void schedule_send(Replay *replay, gint64 delay);
+
+/**
+ * start_server:
+ * @address: the bus address
+ * @error: return location for an error
+ *
+ * Connects a minimal notification daemon to the bus, so the calls have
+ * someone to answer them.
+ *
+ * Returns: the daemon, or NULL on error.
+ **/
+static NotifyServer *
+start_server(const gchar *address, GError **error)
+{
+  GDBusConnection *connection;
+  NotifyServer *server;
+
+  connection = g_dbus_connection_new_for_address_sync(address,
+      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+      NULL, NULL, error);
+  if(connection == NULL)
+    return NULL;
+
+  server = notify_server_new(connection, error);
+  g_object_unref(connection);
+
+  return server;
+}
+
+static void
+maybe_quit(Replay *replay)
+{
+  if(replay->finished && replay->in_flight == 0)
+    g_main_loop_quit(replay->loop);
+}
+
+static void
+notify_reply_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  Replay *replay = user_data;
+  GError *error = NULL;
+  GVariant *result;
+
+  result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+  if(result != NULL) {
+    replay->replied++;
+    g_variant_unref(result);
+  }
+  else {
+    if(replay->failed == 0)
+      g_printerr("Notify failed: %s\n", error->message);
+    replay->failed++;
+    g_error_free(error);
+  }
+
+  /* Resume sending if it was waiting for replies */
+  if(replay->in_flight-- == MAX_IN_FLIGHT && replay->source_id == 0 && !replay->finished)
+    schedule_send(replay, 0);
+
+  maybe_quit(replay);
+}
+
+/**
+ * send_due:
+ * @user_data: the replay state
+ *
+ * Sends every record that is due, then schedules itself for the next one.
+ **/
+static gboolean
+send_due(gpointer user_data)
+{
+  Replay *replay = user_data;
+  guint batch = 0;
+
+  replay->source_id = 0;
+
+  while(replay->in_flight < MAX_IN_FLIGHT && batch < MAX_BATCH) {
+    if(replay->next_body == NULL
+        && !notify_recording_next(replay->recording, &replay->next_timestamp, &replay->next_body)) {
+      replay->finished = TRUE;
+      maybe_quit(replay);
+      return FALSE;
+    }
+
+    if(replay->sent == 0)
+      replay->first_timestamp = replay->next_timestamp;
+
+    if(replay->speed > 0) {
+      gint64 due = replay->start_time
+        + (gint64) ((replay->next_timestamp - replay->first_timestamp) / replay->speed);
+      gint64 now = g_get_monotonic_time();
+
+      if(due > now) {
+        schedule_send(replay, due - now);
+        return FALSE;
+      }
+    }
+
+    g_dbus_connection_call(replay->connection, NOTIFICATIONS_NAME, NOTIFICATIONS_PATH,
+                           NOTIFICATIONS_INTERFACE, "Notify", replay->next_body,
+                           G_VARIANT_TYPE("(u)"), G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+                           NULL, notify_reply_cb, replay);
+    g_variant_unref(replay->next_body);
+    replay->next_body = NULL;
+
+    replay->in_flight++;
+    replay->sent++;
+    batch++;
+  }
+
+  /* Otherwise it is resumed by the replies */
+  if(replay->in_flight < MAX_IN_FLIGHT)
+    schedule_send(replay, 0);
+
+  return FALSE;
+}
+
+static void
+schedule_send(Replay *replay, gint64 delay)
+{
+  if(delay <= 0)
+    replay->source_id = g_idle_add(send_due, replay);
+  else
+    replay->source_id = g_timeout_add(MAX(delay / 1000, 1), send_due, replay);
+}
+
+int
+main(int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GTestDBus *bus = NULL;
+  NotifyServer *server = NULL;
+  GPid child = 0;
+  const gchar *address;
+  Replay replay = { 0 };
+  gint64 elapsed;
+  int status = EXIT_SUCCESS;
+
+  context = g_option_context_new(NULL);
+  g_option_context_set_summary(context, "Replay a recording of notifications on a private bus.");
+  g_option_context_add_main_entries(context, option_entries, NULL);
+
+  if(!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  if(option_remaining == NULL || option_remaining[0] == NULL || option_speed < 0) {
+    g_printerr("%s", g_option_context_get_help(context, TRUE, NULL));
+    return EXIT_FAILURE;
+  }
+
+  g_option_context_free(context);
+
+  replay.speed = option_speed;
+  replay.recording = notify_recording_open(option_remaining[0], &error);
+  if(replay.recording == NULL) {
+    g_printerr("%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  /* Start a private bus, this also points DBUS_SESSION_BUS_ADDRESS at it */
+  if(option_address == NULL) {
+    bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(bus);
+    address = g_test_dbus_get_bus_address(bus);
+    g_print("DBUS_SESSION_BUS_ADDRESS=%s\n", address);
+  }
+  else {
+    address = option_address;
+  }
+
+  if(!option_no_server && (server = start_server(address, &error)) == NULL)
+    goto failed;
+
+  replay.connection = g_dbus_connection_new_for_address_sync(address,
+      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+      NULL, NULL, &error);
+  if(replay.connection == NULL)
+    goto failed;
+
+  if(option_remaining[1] != NULL) {
+    if(!g_spawn_async(NULL, option_remaining + 1, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, &child, &error))
+      goto failed;
+    g_usleep((gulong) (option_delay * G_USEC_PER_SEC));
+  }
+
+  replay.loop = g_main_loop_new(NULL, FALSE);
+  replay.start_time = g_get_monotonic_time();
+  schedule_send(&replay, 0);
+  g_main_loop_run(replay.loop);
+  elapsed = g_get_monotonic_time() - replay.start_time;
+
+  g_print("Sent %u notifications in %.3f s (%.1f/s), %u replies, %u failed\n",
+          replay.sent, elapsed / (gdouble) G_USEC_PER_SEC,
+          elapsed > 0 ? replay.sent * (gdouble) G_USEC_PER_SEC / elapsed : 0.0,
+          replay.replied, replay.failed);
+
+  g_main_loop_unref(replay.loop);
+
+failed:
+  if(error != NULL) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    status = EXIT_FAILURE;
+  }
+
+  if(child != 0) {
+    kill(child, SIGTERM);
+    g_spawn_close_pid(child);
+  }
+
+  g_clear_object(&replay.connection);
+  g_clear_pointer(&server, notify_server_free);
+  notify_recording_close(replay.recording);
+
+  if(bus != NULL) {
+    g_test_dbus_down(bus);
+    g_object_unref(bus);
+  }
+
+  return replay.failed == 0 ? status : EXIT_FAILURE;
+}
@@ -0,0 +1,121 @@
+/*
+ * notify-server.c - A minimal notification daemon for the replayer and benchmarks.
+ *
+ * It only implements Notify, answering every call with a new id, or with the
+ * replaces_id of the call, like a real daemon would. Nothing is shown.
+ */
+
+#include "notify-server.h"
+
+struct _NotifyServer {
+  GDBusConnection *connection;
+  guint            registration_id;
+  guint32          last_id;
+};
+
+static const gchar introspection_xml[] =
+  "<node>"
+  "  <interface name='" NOTIFICATIONS_INTERFACE "'>"
+  "    <method name='Notify'>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='u' direction='in'/>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='s' direction='in'/>"
+  "      <arg type='as' direction='in'/>"
+  "      <arg type='a{sv}' direction='in'/>"
+  "      <arg type='i' direction='in'/>"
+  "      <arg type='u' direction='out'/>"
+  "    </method>"
+  "  </interface>"
+  "</node>";
+
+static void
+server_method_call(GDBusConnection *connection, const gchar *sender,
+                   const gchar *object_path, const gchar *interface_name,
+                   const gchar *method_name, GVariant *parameters,
+                   GDBusMethodInvocation *invocation, gpointer user_data)
+{
+  NotifyServer *server = user_data;
+  guint32 replaces_id;
+
+  g_variant_get_child(parameters, 1, "u", &replaces_id);
+  if(replaces_id == 0)
+    replaces_id = ++server->last_id;
+
+  g_dbus_method_invocation_return_value(invocation, g_variant_new("(u)", replaces_id));
+}
+
+static const GDBusInterfaceVTable server_vtable = {
+  server_method_call, NULL, NULL
+};
+
+/**
+ * notify_server_new:
+ * @connection: a connection to the bus
+ * @error: return location for an error
+ *
+ * Answers the Notify calls on the bus as the notification daemon. The calls
+ * are answered in the thread-default main context of the caller. If another
+ * daemon already owns the name, it is left to answer them.
+ *
+ * Returns: the server, or NULL on error.
+ **/
+NotifyServer *
+notify_server_new(GDBusConnection *connection, GError **error)
+{
+  g_return_val_if_fail(G_IS_DBUS_CONNECTION(connection), NULL);
+  NotifyServer *server = g_new0(NotifyServer, 1);
+  GDBusNodeInfo *info;
+  GVariant *result;
+  guint32 reply;
+
+  server->connection = g_object_ref(connection);
+
+  info = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
+  server->registration_id = g_dbus_connection_register_object(connection, NOTIFICATIONS_PATH,
+                                                              info->interfaces[0], &server_vtable,
+                                                              server, NULL, error);
+  g_dbus_node_info_unref(info);
+
+  if(server->registration_id == 0) {
+    notify_server_free(server);
+    return NULL;
+  }
+
+  result = g_dbus_connection_call_sync(connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus", "RequestName",
+                                       g_variant_new("(su)", NOTIFICATIONS_NAME, 0x4),
+                                       G_VARIANT_TYPE("(u)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, error);
+  if(result == NULL) {
+    notify_server_free(server);
+    return NULL;
+  }
+
+  g_variant_get(result, "(u)", &reply);
+  g_variant_unref(result);
+
+  /* 1 is DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER */
+  if(reply != 1)
+    g_printerr("%s is already owned, not answering the calls\n", NOTIFICATIONS_NAME);
+
+  return server;
+}
+
+/**
+ * notify_server_free:
+ * @server: the server
+ *
+ * Stops answering the calls. The name is released with the connection.
+ **/
+void
+notify_server_free(NotifyServer *server)
+{
+  g_return_if_fail(server != NULL);
+
+  if(server->registration_id != 0)
+    g_dbus_connection_unregister_object(server->connection, server->registration_id);
+
+  g_object_unref(server->connection);
+  g_free(server);
+}
@@ -0,0 +1,23 @@
+/*
+ * notify-server.h - A minimal notification daemon for the replayer and benchmarks.
+ */
+
+#ifndef __NOTIFY_SERVER_H__
+#define __NOTIFY_SERVER_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define NOTIFICATIONS_NAME      "org.freedesktop.Notifications"
+#define NOTIFICATIONS_PATH      "/org/freedesktop/Notifications"
+#define NOTIFICATIONS_INTERFACE "org.freedesktop.Notifications"
+
+typedef struct _NotifyServer NotifyServer;
+
+NotifyServer *notify_server_new(GDBusConnection *connection, GError **error);
+void          notify_server_free(NotifyServer *server);
+
+G_END_DECLS
+
+#endif /* __NOTIFY_SERVER_H__ */
@@ -0,0 +1,161 @@
+/*
+ * rate-limiter.c - A token bucket rate limiter keyed by application name.
+ */
+
+#include "rate-limiter.h"
+
+/* Once there are this many buckets, the ones that have refilled are dropped */
+#define RATE_LIMITER_MAX_BUCKETS 256
+
+typedef struct {
+  gdouble tokens;
+  gint64  last_refill;
+} Bucket;
+
+/* What bucket_is_full() needs to refill a bucket */
+typedef struct {
+  RateLimiter *limiter;
+  gint64       now;
+} RefillData;
+
+struct _RateLimiter {
+  gdouble     rate;
+  guint       burst;
+  GHashTable *buckets;
+};
+
+static void     bucket_refill(RateLimiter *limiter, Bucket *bucket, gint64 now);
+static gboolean bucket_is_full(gpointer key, gpointer value, gpointer user_data);
+
+/**
+ * rate_limiter_new:
+ * @rate: the number of tokens added to each bucket per second, 0 disables limiting
+ * @burst: the size of each bucket
+ *
+ * Creates a new rate limiter. Each key gets its own bucket holding up to
+ * @burst tokens, and each allowed event takes one token.
+ **/
+RateLimiter *
+rate_limiter_new(gdouble rate, guint burst)
+{
+  RateLimiter *limiter = g_new0(RateLimiter, 1);
+
+  limiter->buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  rate_limiter_set_rate(limiter, rate, burst);
+
+  return limiter;
+}
+
+/**
+ * rate_limiter_free:
+ * @limiter: the rate limiter
+ *
+ * Frees the rate limiter and all of its buckets.
+ **/
+void
+rate_limiter_free(RateLimiter *limiter)
+{
+  g_return_if_fail(limiter != NULL);
+
+  g_hash_table_unref(limiter->buckets);
+  g_free(limiter);
+}
+
+/**
+ * rate_limiter_set_rate:
+ * @limiter: the rate limiter
+ * @rate: the number of tokens added to each bucket per second, 0 disables limiting
+ * @burst: the size of each bucket
+ *
+ * Changes the rate and burst size. Existing buckets keep their tokens, up to
+ * the new burst size.
+ **/
+void
+rate_limiter_set_rate(RateLimiter *limiter, gdouble rate, guint burst)
+{
+  g_return_if_fail(limiter != NULL);
+
+  limiter->rate = MAX(rate, 0);
+  limiter->burst = MAX(burst, 1);
+}
+
+/**
+ * rate_limiter_allow:
+ * @limiter: the rate limiter
+ * @key: the application name
+ * @now: the current monotonic time in microseconds
+ *
+ * Takes a token from the bucket for @key, if there is one.
+ *
+ * Returns: TRUE if the event is within the rate limit.
+ **/
+gboolean
+rate_limiter_allow(RateLimiter *limiter, const gchar *key, gint64 now)
+{
+  g_return_val_if_fail(limiter != NULL, TRUE);
+  Bucket *bucket;
+
+  if(limiter->rate <= 0)
+    return TRUE;
+
+  bucket = g_hash_table_lookup(limiter->buckets, key);
+
+  if(bucket == NULL) {
+    if(g_hash_table_size(limiter->buckets) >= RATE_LIMITER_MAX_BUCKETS) {
+      RefillData data = { limiter, now };
+      g_hash_table_foreach_remove(limiter->buckets, bucket_is_full, &data);
+    }
+
+    bucket = g_new0(Bucket, 1);
+    bucket->tokens = limiter->burst;
+    bucket->last_refill = now;
+    g_hash_table_insert(limiter->buckets, g_strdup(key), bucket);
+  }
+  else {
+    bucket_refill(limiter, bucket, now);
+  }
+
+  if(bucket->tokens < 1)
+    return FALSE;
+
+  bucket->tokens -= 1;
+  return TRUE;
+}
+
+/**
+ * bucket_refill:
+ * @limiter: the rate limiter
+ * @bucket: the bucket
+ * @now: the current monotonic time in microseconds
+ *
+ * Adds the tokens earned since the last refill, up to the burst size.
+ **/
+static void
+bucket_refill(RateLimiter *limiter, Bucket *bucket, gint64 now)
+{
+  if(now > bucket->last_refill) {
+    bucket->tokens += (now - bucket->last_refill) * limiter->rate / G_USEC_PER_SEC;
+    bucket->tokens = MIN(bucket->tokens, limiter->burst);
+    bucket->last_refill = now;
+  }
+}
+
+/**
+ * bucket_is_full:
+ * @key: the application name
+ * @value: the bucket
+ * @user_data: a RefillData with the time passed to rate_limiter_allow()
+ *
+ * A GHRFunc that matches buckets which would be full by now, since dropping
+ * them makes no difference to the rate limit.
+ **/
+static gboolean
+bucket_is_full(gpointer key, gpointer value, gpointer user_data)
+{
+  RefillData *data = (RefillData *)user_data;
+  Bucket *bucket = (Bucket *)value;
+
+  bucket_refill(data->limiter, bucket, data->now);
+
+  return bucket->tokens >= data->limiter->burst;
+}
@@ -0,0 +1,21 @@
+/*
+ * rate-limiter.h - A token bucket rate limiter keyed by application name.
+ */
+
+#ifndef __RATE_LIMITER_H__
+#define __RATE_LIMITER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _RateLimiter RateLimiter;
+
+RateLimiter *rate_limiter_new(gdouble rate, guint burst);
+void         rate_limiter_free(RateLimiter *limiter);
+void         rate_limiter_set_rate(RateLimiter *limiter, gdouble rate, guint burst);
+gboolean     rate_limiter_allow(RateLimiter *limiter, const gchar *key, gint64 now);
+
+G_END_DECLS
+
+#endif /* __RATE_LIMITER_H__ */
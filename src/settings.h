@@ -13,6 +13,15 @@
 #define NOTIFICATIONS_KEY_HIDE_INDICATOR      "hide-indicator"
 #define NOTIFICATIONS_KEY_MAX_ITEMS           "max-items"
 #define NOTIFICATIONS_KEY_SWAP_CLEAR_SETTINGS "swap-clear-settings"
+#define NOTIFICATIONS_KEY_GROUP_BY_APP        "group-by-app"
+#define NOTIFICATIONS_KEY_QUEUE_SIZE          "queue-size"
+#define NOTIFICATIONS_KEY_QUEUE_POLICY        "queue-overflow-policy"
+#define NOTIFICATIONS_KEY_RATE_LIMIT          "rate-limit"
+#define NOTIFICATIONS_KEY_RATE_LIMIT_BURST    "rate-limit-burst"
+#define NOTIFICATIONS_KEY_DEDUP_WINDOW        "dedup-window"
+#define NOTIFICATIONS_KEY_HISTORY_SIZE        "history-size"
+#define NOTIFICATIONS_KEY_HISTORY_PERSIST     "history-persist"
+#define NOTIFICATIONS_KEY_HISTORY_MAX_FILE_SIZE "history-max-file-size"
 
 #define MATE_SCHEMA  "org.mate.NotificationDaemon"
 #define MATE_KEY_DND "do-not-disturb"
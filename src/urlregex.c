@@ -19,258 +19,322 @@
 #define USERPASS USERCHARS_CLASS "+(?:" PASSCHARS_CLASS "+)?"
 #define URLPATH   "(?:(/"PATHCHARS_CLASS"+(?:[(]"PATHCHARS_CLASS"*[)])*"PATHCHARS_CLASS"*)*"PATHTERM_CLASS")?"
 
-typedef enum {
-  FLAVOR_AS_IS,
-  FLAVOR_DEFAULT_TO_HTTP,
-  FLAVOR_EMAIL,
-  FLAVOR_LP
-} UrlRegexFlavor;
-
 typedef struct {
   const char        *pattern;
-  UrlRegexFlavor     flavor;
+  MatchKind          kind;
   GRegexCompileFlags flags;
 } UrlRegexPattern;
 
 static UrlRegexPattern url_regex_patterns[] = {
-  { SCHEME "//(?:" USERPASS "\\@)?" HOST PORT URLPATH, FLAVOR_AS_IS, G_REGEX_CASELESS },
-  { "(?:www|ftp)" HOSTCHARS_CLASS "*\\." HOST PORT URLPATH, FLAVOR_DEFAULT_TO_HTTP, G_REGEX_CASELESS},
-  { "(?:mailto:)?" USERCHARS_CLASS "[" USERCHARS ".]*\\@" HOSTCHARS_CLASS "+\\." HOST, FLAVOR_EMAIL, G_REGEX_CASELESS  },
-  { "(?:lp: #)([[:digit:]]+)", FLAVOR_LP, G_REGEX_CASELESS}
+  { SCHEME "//(?:" USERPASS "\\@)?" HOST PORT URLPATH, MATCH_AS_IS, G_REGEX_CASELESS },
+  { "(?:www|ftp)" HOSTCHARS_CLASS "*\\." HOST PORT URLPATH, MATCH_DEFAULT_TO_HTTP, G_REGEX_CASELESS},
+  { "(?:mailto:)?" USERCHARS_CLASS "[" USERCHARS ".]*\\@" HOSTCHARS_CLASS "+\\." HOST, MATCH_EMAIL, G_REGEX_CASELESS  },
+  { "(?:lp: #)([[:digit:]]+)", MATCH_LP, G_REGEX_CASELESS}
 };
 
-static GRegex         **url_regexes;
-static UrlRegexFlavor  *url_regex_flavors;
-static guint            n_url_regexes;
+/* The length of the "lp: #" before the bug number */
+#define LP_PREFIX_LENGTH 5
+
+/* The bytes none of the patterns match, apart from the space in "lp: #" */
+#define URLREGEX_IS_BREAK(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+/* Every url the patterns match has at least one of these bytes in it */
+static const char url_triggers[] = { ':', '@', '.' };
+
+/* Only written once, by urlregex_init(), so any thread can match with them */
+static GRegex **url_regexes;
 
-static char *urlregex_expand(GMatchInfo *match_info, UrlRegexFlavor flavor);
+static GPrivate thread_spans = G_PRIVATE_INIT((GDestroyNotify) g_array_unref);
+
+static void urlregex_init(void);
+static gsize urlregex_next_trigger(const char *text, gsize length, gsize from, gssize *found);
+static gboolean urlregex_is_candidate(const char *token, gsize length);
+static void urlregex_scan(const char *text, gint start, gint end, guint index, GArray *spans);
+static void urlregex_append_span(GArray *spans, gint start, gint end, MatchKind kind);
 
 /**
  * urlregex_init:
  *
- * Compiles all of the url matching regular expressions.
- * FIXME: Return immediately or error if initialized more than once
+ * Compiles all of the url matching regular expressions the first time it is
+ * called, from whichever thread gets there first.
  **/
-void
+static void
 urlregex_init(void)
 {
+  static gsize initialized = 0;
+  GRegex **regexes;
   guint i;
 
-  n_url_regexes = G_N_ELEMENTS(url_regex_patterns);
-  url_regexes = g_new0(GRegex*, n_url_regexes);
-  url_regex_flavors = g_new0(UrlRegexFlavor, n_url_regexes);
+  if (!g_once_init_enter(&initialized))
+    return;
 
-  for (i = 0; i < n_url_regexes; i++) {
+  regexes = g_new0(GRegex*, G_N_ELEMENTS(url_regex_patterns));
+
+  for (i = 0; i < G_N_ELEMENTS(url_regex_patterns); i++) {
     GError *error = NULL;
 
-    url_regexes[i] = g_regex_new(url_regex_patterns[i].pattern,
+    regexes[i] = g_regex_new(url_regex_patterns[i].pattern,
         url_regex_patterns[i].flags | G_REGEX_OPTIMIZE, 0, &error);
 
     if (error != NULL) {
       g_message("%s", error->message);
       g_error_free(error);
     }
-
-    url_regex_flavors[i] = url_regex_patterns[i].flavor;
   }
+
+  url_regexes = regexes;
+  g_once_init_leave(&initialized, 1);
 }
 
 /**
- * urlregex_count:
+ * urlregex_get_spans:
+ *
+ * Gets an array for urlregex_find_spans() that belongs to the calling
+ * thread, so the spans don't need a new array every time.
  *
- * Returns the number of available url patterns.
+ * Returns: (transfer none) (element-type MatchSpan): the array.
  **/
-guint
-urlregex_count(void)
+GArray *
+urlregex_get_spans(void)
 {
-  return n_url_regexes;
+  GArray *spans = g_private_get(&thread_spans);
+
+  if (spans == NULL) {
+    spans = g_array_sized_new(FALSE, FALSE, sizeof(MatchSpan), 16);
+    g_private_set(&thread_spans, spans);
+  }
+
+  return spans;
 }
 
 /**
- * urlregex_split:
+ * urlregex_find_spans:
  * @text: the text to split
- * @index: the pattern to use
+ * @length: the length of @text in bytes
+ * @spans: (element-type MatchSpan): the array to fill with the spans
+ *
+ * Splits the text into MatchSpan slices of it, giving each url pattern
+ * available precedence over the ones after it. Nothing is copied, so the
+ * caller can keep reusing the same array.
  *
- * Splits the text into a list of MatchGroup objects.
+ * None of the patterns match across a space, tab or line break, other than
+ * the one in "lp: #", so the patterns are only run on the words that could
+ * hold a url. Text without any is a single unmatched span.
  **/
-GList *
-urlregex_split(const char *text, guint index)
+void
+urlregex_find_spans(const char *text, gsize length, GArray *spans)
 {
-  GList *result = NULL;
-  GRegex *pattern = url_regexes[index];
-  GMatchInfo *match_info;
-  int text_length = strlen(text);
+  gssize found[G_N_ELEMENTS(url_triggers)];
+  gsize last = 0;
+  gsize from = 0;
+  gsize trigger;
+  guint i;
 
-  int start_pos = 0;
-  int end_pos = 0;
-  int last_pos = 0;
-  int len = 0;
+  g_return_if_fail(text != NULL);
+  g_return_if_fail(spans != NULL);
+  g_return_if_fail(length <= G_MAXINT);
 
-  gchar *token;
-  gchar *expanded;
+  urlregex_init();
+  g_array_set_size(spans, 0);
 
-  g_regex_match(pattern, text, 0, &match_info);
+  for (i = 0; i < G_N_ELEMENTS(url_triggers); i++)
+    found[i] = -1;
 
-  while (g_match_info_matches(match_info)) {
-    /* Append previously unmatched text */
-    g_match_info_fetch_pos(match_info, 0, &start_pos, &end_pos);
-    len = start_pos - last_pos;
-    if (len > 0) {
-      token = g_strndup(text + last_pos, len);
-      result = g_list_append(result, urlregex_matchgroup_new(token, token, NOT_MATCHED));
-      g_free(token);
-    }
+  while ((trigger = urlregex_next_trigger(text, length, from, found)) < length) {
+    gsize start = trigger;
+    gsize end = trigger;
 
-    /* Append matched text */
-    token = urlregex_expand(match_info, FLAVOR_AS_IS);
-    expanded = urlregex_expand(match_info, url_regex_flavors[index]);
-    result = g_list_append(result, urlregex_matchgroup_new(token, expanded, MATCHED));
-    g_free(token);
-    g_free(expanded);
+    while (start > from && !URLREGEX_IS_BREAK(text[start - 1]))
+      start--;
+    while (end < length && !URLREGEX_IS_BREAK(text[end]))
+      end++;
 
-    g_match_info_next(match_info, NULL);
-    last_pos = end_pos;
-  }
-  /* Append the text after the last match */
-  if (last_pos < text_length) {
-    token = g_strdup(text + last_pos);
-    result = g_list_append(result, urlregex_matchgroup_new(token, token, NOT_MATCHED));
-    g_free(token);
-  }
+    from = end;
+    if (!urlregex_is_candidate(text + start, end - start))
+      continue;
 
-  g_match_info_free(match_info);
+    /* Keep the bug number with the "lp:" before it */
+    while (end + 1 < length && text[end] == ' ' && text[end + 1] == '#') {
+      for (end += 2; end < length && !URLREGEX_IS_BREAK(text[end]); end++);
+    }
 
-  return result;
+    urlregex_append_span(spans, last, start, MATCH_NONE);
+    urlregex_scan(text, start, end, 0, spans);
+    last = from = end;
+  }
+
+  urlregex_append_span(spans, last, length, MATCH_NONE);
 }
 
 /**
- * urlregex_expand:
- * @match_info: describes the matched url
- * @flavor: the type of url
+ * urlregex_next_trigger:
+ * @text: the text being split
+ * @length: the length of @text in bytes
+ * @from: where to search from
+ * @found: where each trigger byte was last found, or -1 before searching
  *
- * Expands the matched url based on the given flavor.
+ * Finds the next byte that every url has one of. Each trigger byte is
+ * searched for with memchr(), which libc vectorizes, and only again once the
+ * search has gone past where it was last found.
+ *
+ * Returns: the position of the trigger, or @length if there is none.
  **/
-static char *
-urlregex_expand(GMatchInfo *match_info, UrlRegexFlavor flavor)
+static gsize
+urlregex_next_trigger(const char *text, gsize length, gsize from, gssize *found)
 {
-  char *t1;
-  char *t2;
-
-  switch(flavor) {
-    case FLAVOR_DEFAULT_TO_HTTP:
-      t1 = g_match_info_fetch(match_info, 0);
-      t2 = g_strconcat(HTTP_BASE_URL, t1, NULL);
-      g_free(t1);
-      return t2;
-    case FLAVOR_EMAIL:
-      t1 = g_match_info_fetch(match_info, 0);
-      if (!g_str_has_prefix(t1, MAILTO_BASE_URL)) {
-        t2 = g_strconcat(MAILTO_BASE_URL, t1, NULL);
-        g_free(t1);
-        return t2;
-      }
-      else
-        return t1;
-    case FLAVOR_LP:
-      t1 = g_match_info_fetch(match_info, 1);
-      t2 = g_strconcat(LP_BUG_BASE_URL, t1, NULL);
-      g_free(t1);
-      return t2;
-    default:
-      return g_match_info_fetch(match_info, 0);
+  gsize next = length;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS(url_triggers); i++) {
+    if (found[i] < (gssize) from) {
+      const char *byte = memchr(text + from, url_triggers[i], length - from);
+      found[i] = byte ? byte - text : (gssize) length;
+    }
+
+    next = MIN(next, (gsize) found[i]);
   }
+
+  return next;
 }
 
 /**
- * urlregex_split_all:
- * @text: the text to split
+ * urlregex_is_candidate:
+ * @token: a word of the text
+ * @length: the length of @token in bytes
  *
- * Splits the text into a list of MatchGroup objects, applying each url pattern
- * available in order to each of the unmatched sections, keeping the list flat.
+ * Checks if the word has what one of the patterns needs: a ':' for the
+ * schemes and "lp:", an '@' for email addresses, or a "www" or "ftp" for
+ * host names with a '.' after them.
  **/
-GList *
-urlregex_split_all(const char *text)
+static gboolean
+urlregex_is_candidate(const char *token, gsize length)
 {
-  GList *result = NULL;
-  GList *temp = NULL;
-  guint i;
+  gsize i;
 
-  result = g_list_append(result, urlregex_matchgroup_new(text, text, NOT_MATCHED));
-
-  /* Apply each regex in order to sections that haven't yet been matched */
-  for (i = 0; i < n_url_regexes; i++) {
-    GList *item;
-    temp = NULL;
-    for (item = result; item; item = item->next) {
-      MatchGroup *group = (MatchGroup *)item->data;
-      if (group->type == NOT_MATCHED) {
-        GList *list = urlregex_split(group->text, i);
-        GList *subitem;
-        for (subitem = list; subitem; subitem = subitem->next) {
-          MatchGroup *subgroup = (MatchGroup *)subitem->data;
-          temp = g_list_append(temp, subgroup);
-        }
-        g_list_free(list);
-        urlregex_matchgroup_free(group);
-      }
-      else {
-        temp = g_list_append(temp, group);
-      }
-    }
-    g_list_free(result);
-    result = temp;
+  if (memchr(token, ':', length) || memchr(token, '@', length))
+    return TRUE;
+
+  for (i = 0; i + 3 <= length; i++) {
+    if (g_ascii_strncasecmp(token + i, "www", 3) == 0 ||
+        g_ascii_strncasecmp(token + i, "ftp", 3) == 0)
+      return TRUE;
   }
 
-  return result;
+  return FALSE;
 }
 
 /**
- * urlregex_matchgroup_new:
- * @text: the original text
- * @expanded: the expanded url
- * @type: whether this is a matched or unmatched group
+ * urlregex_span_href:
+ * @text: the text that was split
+ * @span: a matched span of it
+ * @target: (out): the part of @text the url continues with
+ * @target_length: (out): the length of @target
  *
- * Creates a new MatchGroup object.
+ * Expands the matched url based on the kind of the span, without copying it.
+ * The url is the returned prefix followed by @target_length bytes of @target.
+ *
+ * Returns: the prefix of the url, which is static and may be empty.
  **/
-MatchGroup *
-urlregex_matchgroup_new(const char *text, const char *expanded, MatchType type)
+const char *
+urlregex_span_href(const char *text, const MatchSpan *span, const char **target, gsize *target_length)
 {
-  MatchGroup *result = g_new0(MatchGroup, 1);
-  result->text = g_strdup(text);
-  /* TODO: Save space using same data if text == expanded? */
-  result->expanded = g_strdup(expanded);
-  result->type = type;
-  return result;
+  const char *match = text + span->offset;
+
+  *target = match;
+  *target_length = span->length;
+
+  switch(span->kind) {
+    case MATCH_DEFAULT_TO_HTTP:
+      return HTTP_BASE_URL;
+    case MATCH_EMAIL:
+      if (span->length >= strlen(MAILTO_BASE_URL) && strncmp(match, MAILTO_BASE_URL, strlen(MAILTO_BASE_URL)) == 0)
+        return "";
+      return MAILTO_BASE_URL;
+    case MATCH_LP:
+      *target = match + LP_PREFIX_LENGTH;
+      *target_length = span->length - LP_PREFIX_LENGTH;
+      return LP_BUG_BASE_URL;
+    default:
+      return "";
+  }
 }
 
 /**
- * urlregex_matchgroup_free:
- * @group: the match group
+ * urlregex_scan:
+ * @text: the text being split
+ * @start: the start of the part to split
+ * @end: the end of the part to split
+ * @index: the first pattern to use
+ * @spans: the array the spans are appended to
  *
- * Frees the MatchGroup object.
+ * Splits part of the text into spans with the patterns from @index on. Each
+ * pattern only sees the parts the patterns before it left unmatched, the same
+ * as applying them one after another, but the text is walked once from left
+ * to right and the spans are appended in order.
  **/
-void
-urlregex_matchgroup_free(MatchGroup *group)
+static void
+urlregex_scan(const char *text, gint start, gint end, guint index, GArray *spans)
 {
-  g_free(group->expanded);
-  group->expanded = NULL;
-  g_free(group->text);
-  group->text = NULL;
-  g_free(group);
+  GMatchInfo *match_info;
+  gint match_start;
+  gint match_end;
+  gint last = start;
+
+  if (start >= end)
+    return;
+
+  if (index >= G_N_ELEMENTS(url_regex_patterns)) {
+    urlregex_append_span(spans, start, end, MATCH_NONE);
+    return;
+  }
+
+  /* Limiting the length keeps the match inside the part */
+  g_regex_match_full(url_regexes[index], text, end, start, 0, &match_info, NULL);
+
+  while (g_match_info_matches(match_info)) {
+    g_match_info_fetch_pos(match_info, 0, &match_start, &match_end);
+
+    urlregex_scan(text, last, match_start, index + 1, spans);
+    urlregex_append_span(spans, match_start, match_end, url_regex_patterns[index].kind);
+    last = match_end;
+
+    g_match_info_next(match_info, NULL);
+  }
+
+  g_match_info_free(match_info);
+
+  urlregex_scan(text, last, end, index + 1, spans);
 }
 
 /**
- * urlregex_matchgroup_list_free:
- * @list: the match group list
+ * urlregex_append_span:
+ * @spans: the array to append to
+ * @start: the start of the span
+ * @end: the end of the span
+ * @kind: what was matched, or MATCH_NONE
  *
- * Frees a list of MatchGroup objects returned from split or split_all.
+ * Appends a span to the array, or extends the last one when both are
+ * unmatched and next to each other. Empty spans are left out.
  **/
-void
-urlregex_matchgroup_list_free(GList *list)
+static void
+urlregex_append_span(GArray *spans, gint start, gint end, MatchKind kind)
 {
-  GList *item;
-  for (item = list; item; item = item->next) {
-    urlregex_matchgroup_free((MatchGroup *)item->data);
+  MatchSpan span;
+
+  if (start >= end)
+    return;
+
+  if (kind == MATCH_NONE && spans->len > 0) {
+    MatchSpan *last = &g_array_index(spans, MatchSpan, spans->len - 1);
+    if (last->kind == MATCH_NONE && last->offset + last->length == (gsize) start) {
+      last->length += end - start;
+      return;
+    }
   }
-  g_list_free(list);
+
+  span.offset = start;
+  span.length = end - start;
+  span.kind = kind;
+
+  g_array_append_val(spans, span);
 }
@@ -8,23 +8,23 @@
 #include <glib.h>
 
 typedef enum {
-  MATCHED,
-  NOT_MATCHED
-} MatchType;
+  MATCH_NONE,
+  MATCH_AS_IS,
+  MATCH_DEFAULT_TO_HTTP,
+  MATCH_EMAIL,
+  MATCH_LP
+} MatchKind;
 
+/* A slice of the split text, which is a url unless the kind is MATCH_NONE */
 typedef struct {
-  char       *text;
-  char       *expanded;
-  MatchType   type;
-} MatchGroup;
+  gsize      offset;
+  gsize      length;
+  MatchKind  kind;
+} MatchSpan;
 
-void   urlregex_init(void);
-guint  urlregex_count(void);
-GList *urlregex_split(const char *text, guint index);
-GList *urlregex_split_all(const char *text);
-
-MatchGroup *urlregex_matchgroup_new(const char *text, const char *expanded, MatchType type);
-void        urlregex_matchgroup_free(MatchGroup *group);
-void        urlregex_matchgroup_list_free(GList *list);
+GArray     *urlregex_get_spans(void);
+void        urlregex_find_spans(const char *text, gsize length, GArray *spans);
+const char *urlregex_span_href(const char *text, const MatchSpan *span,
+                               const char **target, gsize *target_length);
 
 #endif
@@ -0,0 +1,424 @@
+/*
+ * bench-ingest.c - Measure the latency from a Notify call to the indicator menu.
+ *
+ * Starts a private session bus, loads the indicator module and sends Notify
+ * calls to it from a second thread, which also answers them as the
+ * notification daemon. The time from sending each call until the menu has
+ * been updated with it is reported with the throughput and the peak RSS.
+ *
+ * Only the newest max-items notifications get a menuitem, but every menu
+ * update inserts one for the newest notification in the store. The calls
+ * reach the store in the order they were sent, so that insert marks every
+ * notification up to it as added. Menuitems are only built while the menu
+ * is open, so it is kept open throughout. GTK needs a display, run it under
+ * xvfb-run when there is none.
+ *
+ *   make -C tests bench BENCH_FLAGS="--count=20000 --rate=0 --urls"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <gtk/gtk.h>
+#include <libindicator/indicator-object.h>
+#include "notify-server.h"
+#include "settings.h"
+
+/* Summary of the calls sent until the indicator is seen to be listening */
+#define WARMUP_SUMMARY "bench-warmup"
+
+/* Calls waiting for a reply are limited to stay below the daemon's limits */
+#define MAX_IN_FLIGHT 64
+
+/* Exit status telling automake the benchmark was skipped */
+#define EXIT_SKIP 77
+
+typedef struct {
+  /* Written by the sender thread only */
+  const gchar     *address;
+  gint64          *sent_at;
+  GDBusConnection *connection;
+  NotifyServer    *server;
+  GMainContext    *context;
+  guint            in_flight;
+  guint            sent;
+  gchar           *body;
+
+  /* Written by the main thread only */
+  gint64          *added_at;
+  guint            added;
+  gint64           last_progress;
+  GMainLoop       *loop;
+
+  gint             ready;
+  gint             done_sending;
+} Bench;
+
+static gint      option_count = 10000;
+static gdouble   option_rate = 0;
+static gint      option_body_size = 200;
+static gint      option_apps = 8;
+static gboolean  option_urls = FALSE;
+static gint      option_timeout = 10;
+static gchar    *option_module = NULL;
+
+static GOptionEntry option_entries[] = {
+  { "count", 'n', 0, G_OPTION_ARG_INT, &option_count,
+    "Number of notifications to send", "N" },
+  { "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &option_rate,
+    "Notifications per second, 0 for as fast as possible", "RATE" },
+  { "body-size", 'b', 0, G_OPTION_ARG_INT, &option_body_size,
+    "Length of each notification body", "BYTES" },
+  { "apps", 'a', 0, G_OPTION_ARG_INT, &option_apps,
+    "Number of application names to cycle through", "N" },
+  { "urls", 'u', 0, G_OPTION_ARG_NONE, &option_urls,
+    "Put links in the bodies", NULL },
+  { "timeout", 't', 0, G_OPTION_ARG_INT, &option_timeout,
+    "Seconds to wait for the menu to update before giving up", "SECONDS" },
+  { "module", 'm', 0, G_OPTION_ARG_FILENAME, &option_module,
+    "The indicator module to load", "PATH" },
+  { NULL }
+};
+
+/**
+ * make_body:
+ * @size: the length of the body
+ * @urls: whether to include links
+ *
+ * Returns: a body of words, with a link about every 80 bytes if @urls is set.
+ **/
+static gchar *
+make_body(gsize size, gboolean urls)
+{
+  static const gchar *words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "<b>bold</b>", "&amp;" };
+  GString *body = g_string_sized_new(size + 64);
+  guint i = 0;
+
+  while(body->len < size) {
+    if(urls && i % 10 == 9)
+      g_string_append(body, "https://example.com/some/path?query=1 ");
+    else
+      g_string_append_printf(body, "%s ", words[i % G_N_ELEMENTS(words)]);
+    i++;
+  }
+  g_string_truncate(body, size);
+
+  return g_string_free(body, FALSE);
+}
+
+static void
+notify_reply_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+  Bench *bench = user_data;
+  GVariant *result;
+
+  result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, NULL);
+  if(result != NULL)
+    g_variant_unref(result);
+
+  bench->in_flight--;
+}
+
+static void
+send_notify(Bench *bench, const gchar *app_name, const gchar *summary)
+{
+  bench->in_flight++;
+  g_dbus_connection_call(bench->connection, NOTIFICATIONS_NAME, NOTIFICATIONS_PATH,
+                         NOTIFICATIONS_INTERFACE, "Notify",
+                         g_variant_new("(susssasa{sv}i)", app_name, 0, "", summary, bench->body,
+                                       NULL, NULL, -1),
+                         G_VARIANT_TYPE("(u)"), G_DBUS_CALL_FLAGS_NO_AUTO_START, -1,
+                         NULL, notify_reply_cb, bench);
+}
+
+/**
+ * sender_thread:
+ * @user_data: the benchmark state
+ *
+ * Owns the notification daemon name on its own connection and main context,
+ * so answering and sending the calls does not compete with the indicator.
+ **/
+static gpointer
+sender_thread(gpointer user_data)
+{
+  Bench *bench = user_data;
+  GError *error = NULL;
+  gchar summary[32];
+  gchar app_name[32];
+  gint64 start;
+  gint64 next_warmup = 0;
+
+  g_main_context_push_thread_default(bench->context);
+
+  bench->connection = g_dbus_connection_new_for_address_sync(bench->address,
+      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+      NULL, NULL, &error);
+  if(bench->connection == NULL)
+    g_error("Could not connect to the private bus: %s", error->message);
+
+  bench->server = notify_server_new(bench->connection, &error);
+  if(bench->server == NULL)
+    g_error("Could not answer as the notification daemon: %s", error->message);
+
+  /* Until the indicator has its monitor set up the calls are not seen */
+  while(!g_atomic_int_get(&bench->ready)) {
+    if(g_get_monotonic_time() >= next_warmup && bench->in_flight == 0) {
+      send_notify(bench, "bench", WARMUP_SUMMARY);
+      next_warmup = g_get_monotonic_time() + 50 * 1000;
+    }
+    g_main_context_iteration(bench->context, FALSE);
+    g_usleep(1000);
+  }
+
+  start = g_get_monotonic_time();
+  while(bench->sent < (guint) option_count) {
+    if(option_rate > 0) {
+      gint64 due = start + (gint64) (bench->sent * G_USEC_PER_SEC / option_rate);
+      gint64 now = g_get_monotonic_time();
+
+      if(due > now) {
+        while(g_main_context_iteration(bench->context, FALSE));
+        g_usleep(MIN(due - now, 1000));
+        continue;
+      }
+    }
+
+    while(bench->in_flight >= MAX_IN_FLIGHT)
+      g_main_context_iteration(bench->context, TRUE);
+
+    g_snprintf(app_name, sizeof(app_name), "bench-app-%u", bench->sent % option_apps);
+    g_snprintf(summary, sizeof(summary), "bench-%u", bench->sent);
+    bench->sent_at[bench->sent] = g_get_monotonic_time();
+    send_notify(bench, app_name, summary);
+    bench->sent++;
+
+    while(g_main_context_iteration(bench->context, FALSE));
+  }
+
+  while(bench->in_flight > 0)
+    g_main_context_iteration(bench->context, TRUE);
+
+  g_atomic_int_set(&bench->done_sending, TRUE);
+
+  g_main_context_pop_thread_default(bench->context);
+
+  return NULL;
+}
+
+static void
+find_label(GtkWidget *widget, gpointer user_data)
+{
+  GtkWidget **label = user_data;
+
+  if(*label != NULL)
+    return;
+
+  if(GTK_IS_LABEL(widget))
+    *label = widget;
+  else if(GTK_IS_CONTAINER(widget))
+    gtk_container_forall(GTK_CONTAINER(widget), find_label, user_data);
+}
+
+/**
+ * menu_insert_cb:
+ *
+ * Records the time the menu was updated with a notification and every one
+ * sent before it, identifying the notification by the summary at the start
+ * of the menuitem text.
+ **/
+static void
+menu_insert_cb(GtkMenuShell *menu, GtkWidget *item, gint position, gpointer user_data)
+{
+  Bench *bench = user_data;
+  GtkWidget *label = NULL;
+  const gchar *text;
+  guint index;
+
+  find_label(item, &label);
+  if(label == NULL)
+    return;
+
+  text = gtk_label_get_text(GTK_LABEL(label));
+
+  if(g_str_has_prefix(text, WARMUP_SUMMARY)) {
+    g_atomic_int_set(&bench->ready, TRUE);
+    return;
+  }
+
+  if(sscanf(text, "bench-%u", &index) == 1 && index < (guint) option_count
+      && index >= bench->added) {
+    gint64 now = g_get_monotonic_time();
+
+    while(bench->added <= index)
+      bench->added_at[bench->added++] = now;
+    bench->last_progress = now;
+  }
+}
+
+static gboolean
+check_done(gpointer user_data)
+{
+  Bench *bench = user_data;
+  gint64 now = g_get_monotonic_time();
+
+  if(bench->added == (guint) option_count)
+    g_main_loop_quit(bench->loop);
+  else if(g_atomic_int_get(&bench->done_sending)
+      && now - MAX(bench->last_progress, 0) > option_timeout * G_USEC_PER_SEC)
+    g_main_loop_quit(bench->loop);
+  else if(!g_atomic_int_get(&bench->ready) && now - bench->last_progress > option_timeout * G_USEC_PER_SEC)
+    g_error("The indicator never saw a notification, is the module working?");
+
+  return G_SOURCE_CONTINUE;
+}
+
+static int
+compare_gint64(gconstpointer a, gconstpointer b)
+{
+  gint64 x = *(const gint64 *) a;
+  gint64 y = *(const gint64 *) b;
+
+  return (x > y) - (x < y);
+}
+
+static gint64
+percentile(const gint64 *sorted, guint len, gdouble p)
+{
+  if(len == 0)
+    return 0;
+
+  return sorted[MIN((guint) (p * len), len - 1)];
+}
+
+int
+main(int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GTestDBus *bus;
+  GSettings *settings;
+  IndicatorObject *io;
+  GList *entries;
+  GtkMenu *menu;
+  GThread *thread;
+  Bench bench = { 0 };
+  gint64 *latencies;
+  gint64 start, first_sent = G_MAXINT64, last_added = 0;
+  struct rusage usage;
+  guint i, n = 0;
+
+  context = g_option_context_new(NULL);
+  g_option_context_set_summary(context, "Measure the latency from a Notify call to the indicator menu.");
+  g_option_context_add_main_entries(context, option_entries, NULL);
+
+  if(!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    return EXIT_FAILURE;
+  }
+  g_option_context_free(context);
+
+  if(option_module == NULL || option_count <= 0 || option_apps <= 0 || option_body_size < 0) {
+    g_printerr("A module and positive counts are required, see --help\n");
+    return EXIT_FAILURE;
+  }
+
+  /* Keep the user's settings out of it */
+  g_setenv("GSETTINGS_BACKEND", "memory", TRUE);
+
+  /* The private bus also becomes the session bus of the module */
+  bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+  g_test_dbus_up(bus);
+
+  if(!gtk_init_check(&argc, &argv)) {
+    g_printerr("No display, skipping the benchmark\n");
+    g_test_dbus_down(bus);
+    return EXIT_SKIP;
+  }
+
+  /* Let every notification through to the menu */
+  settings = g_settings_new(NOTIFICATIONS_SCHEMA);
+  g_settings_set_double(settings, NOTIFICATIONS_KEY_RATE_LIMIT, 0);
+  g_settings_set_int(settings, NOTIFICATIONS_KEY_QUEUE_SIZE, 4096);
+
+  /* Leave the user's history alone */
+  g_settings_set_boolean(settings, NOTIFICATIONS_KEY_HISTORY_PERSIST, FALSE);
+
+  io = indicator_object_new_from_file(option_module);
+  if(io == NULL) {
+    g_printerr("Could not load %s\n", option_module);
+    return EXIT_FAILURE;
+  }
+
+  entries = indicator_object_get_entries(io);
+  menu = entries != NULL ? ((IndicatorObjectEntry *) entries->data)->menu : NULL;
+  g_list_free(entries);
+  if(menu == NULL) {
+    g_printerr("The indicator has no menu\n");
+    return EXIT_FAILURE;
+  }
+
+  bench.address = g_test_dbus_get_bus_address(bus);
+  bench.sent_at = g_new0(gint64, option_count);
+  bench.added_at = g_new0(gint64, option_count);
+  bench.body = make_body(option_body_size, option_urls);
+  bench.context = g_main_context_new();
+  bench.loop = g_main_loop_new(NULL, FALSE);
+  bench.last_progress = g_get_monotonic_time();
+
+  g_signal_connect_after(menu, "insert", G_CALLBACK(menu_insert_cb), &bench);
+
+  /* Keep the menu open, so the indicator builds menuitems as notifications arrive */
+  gtk_widget_show(GTK_WIDGET(menu));
+  g_timeout_add(100, check_done, &bench);
+
+  start = g_get_monotonic_time();
+  thread = g_thread_new("bench-sender", sender_thread, &bench);
+  g_main_loop_run(bench.loop);
+  g_thread_join(thread);
+
+  latencies = g_new(gint64, option_count);
+  for(i = 0; i < (guint) option_count; i++) {
+    if(bench.sent_at[i] == 0)
+      continue;
+    first_sent = MIN(first_sent, bench.sent_at[i]);
+
+    if(bench.added_at[i] == 0)
+      continue;
+    latencies[n++] = bench.added_at[i] - bench.sent_at[i];
+    last_added = MAX(last_added, bench.added_at[i]);
+  }
+  qsort(latencies, n, sizeof(gint64), compare_gint64);
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  g_print("notifications: %u sent, %u added, %u lost\n", bench.sent, n, bench.sent - n);
+  g_print("body:          %d bytes%s, %d applications\n", option_body_size,
+          option_urls ? " with links" : "", option_apps);
+  g_print("throughput:    %.1f/s\n",
+          n > 0 && last_added > first_sent
+          ? n * (gdouble) G_USEC_PER_SEC / (last_added - first_sent) : 0.0);
+  g_print("latency:       p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+          percentile(latencies, n, 0.50) / 1000.0,
+          percentile(latencies, n, 0.99) / 1000.0,
+          (n > 0 ? latencies[n - 1] : 0) / 1000.0);
+  g_print("peak rss:      %ld KiB\n", usage.ru_maxrss);
+  g_print("elapsed:       %.3f s\n", (g_get_monotonic_time() - start) / (gdouble) G_USEC_PER_SEC);
+
+  g_free(latencies);
+  g_free(bench.sent_at);
+  g_free(bench.added_at);
+  g_free(bench.body);
+  g_main_loop_unref(bench.loop);
+
+  /* The module keeps its session bus connection, so do not wait for it */
+  g_object_unref(io);
+  g_object_unref(settings);
+  g_clear_pointer(&bench.server, notify_server_free);
+  g_clear_object(&bench.connection);
+  g_main_context_unref(bench.context);
+  g_test_dbus_stop(bus);
+  g_object_unref(bus);
+
+  return n == bench.sent ? EXIT_SUCCESS : EXIT_FAILURE;
+}
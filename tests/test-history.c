@@ -0,0 +1,507 @@
+/*
+ * test-history.c - Check what the notification history restores after
+ * crashes, corruption and interrupted compactions.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "notification-history.h"
+
+#define INDEX_NAME "history.idx"
+#define HEAP_NAME  "history.heap"
+#define TMP_SUFFIX ".tmp"
+
+/* The sizes of the file header and of each index record */
+#define HEADER_SIZE 24
+#define RECORD_SIZE 64
+
+#define MAX_RECORDS   100
+#define MAX_FILE_SIZE (1024 * 1024)
+
+typedef struct {
+  gchar *dir;
+  gchar *index_path;
+  gchar *heap_path;
+} Fixture;
+
+static void
+fixture_set_up(Fixture *fixture, gconstpointer user_data)
+{
+  GError *error = NULL;
+
+  fixture->dir = g_dir_make_tmp("test-history-XXXXXX", &error);
+  g_assert_no_error(error);
+  fixture->index_path = g_build_filename(fixture->dir, INDEX_NAME, NULL);
+  fixture->heap_path = g_build_filename(fixture->dir, HEAP_NAME, NULL);
+}
+
+static void
+fixture_tear_down(Fixture *fixture, gconstpointer user_data)
+{
+  gchar *index_tmp = g_strconcat(fixture->index_path, TMP_SUFFIX, NULL);
+  gchar *heap_tmp = g_strconcat(fixture->heap_path, TMP_SUFFIX, NULL);
+
+  g_unlink(fixture->index_path);
+  g_unlink(fixture->heap_path);
+  g_unlink(index_tmp);
+  g_unlink(heap_tmp);
+  g_rmdir(fixture->dir);
+
+  g_free(index_tmp);
+  g_free(heap_tmp);
+  g_free(fixture->index_path);
+  g_free(fixture->heap_path);
+  g_free(fixture->dir);
+}
+
+static Notification *
+note_new(const gchar *summary)
+{
+  return notification_new_full("test-app", "", summary, strlen(summary), "body", 4, g_get_real_time());
+}
+
+/**
+ * history_open:
+ * @dir: the history directory
+ * @restored: (out): return location for the summaries restored, joined by commas
+ *
+ * Opens the history, which must succeed.
+ **/
+static NotificationHistory *
+history_open(const gchar *dir, gchar **restored)
+{
+  GError *error = NULL;
+  GPtrArray *notes = NULL;
+  NotificationHistory *history = notification_history_open(dir, MAX_RECORDS, MAX_FILE_SIZE, &notes, &error);
+  GString *summaries = g_string_new(NULL);
+  guint i;
+
+  g_assert_no_error(error);
+  g_assert_nonnull(history);
+  g_assert_nonnull(notes);
+
+  for(i = 0; i < notes->len; i++) {
+    if(i > 0)
+      g_string_append_c(summaries, ',');
+    g_string_append(summaries, notification_get_summary(g_ptr_array_index(notes, i)));
+  }
+
+  g_ptr_array_unref(notes);
+  *restored = g_string_free(summaries, FALSE);
+
+  return history;
+}
+
+/**
+ * history_reopen:
+ * @dir: the history directory
+ *
+ * Returns: the summaries restored by opening the history again, joined by commas.
+ **/
+static gchar *
+history_reopen(const gchar *dir)
+{
+  gchar *restored;
+
+  notification_history_free(history_open(dir, &restored));
+
+  return restored;
+}
+
+/**
+ * history_write:
+ * @dir: the history directory
+ * @summaries: a NULL-terminated array of summaries
+ *
+ * Opens the history and appends a notification for each summary.
+ **/
+static void
+history_write(const gchar *dir, const gchar * const *summaries)
+{
+  gchar *restored;
+  NotificationHistory *history = history_open(dir, &restored);
+
+  for(; *summaries != NULL; summaries++) {
+    Notification *note = note_new(*summaries);
+    notification_history_append(history, note);
+    notification_unref(note);
+  }
+
+  notification_history_free(history);
+  g_free(restored);
+}
+
+static void
+file_truncate(const gchar *path, goffset by)
+{
+  GStatBuf st;
+
+  g_assert_cmpint(g_stat(path, &st), ==, 0);
+  g_assert_cmpint(truncate(path, st.st_size - by), ==, 0);
+}
+
+static void
+file_corrupt(const gchar *path, goffset offset)
+{
+  gchar *contents;
+  gsize length;
+  GError *error = NULL;
+
+  g_file_get_contents(path, &contents, &length, &error);
+  g_assert_no_error(error);
+  g_assert_cmpuint(offset, <, length);
+
+  contents[offset] ^= 0x5a;
+
+  g_file_set_contents(path, contents, length, &error);
+  g_assert_no_error(error);
+  g_free(contents);
+}
+
+static void
+file_copy(const gchar *from, const gchar *to)
+{
+  gchar *contents;
+  gsize length;
+  GError *error = NULL;
+
+  g_file_get_contents(from, &contents, &length, &error);
+  g_assert_no_error(error);
+  g_file_set_contents(to, contents, length, &error);
+  g_assert_no_error(error);
+  g_free(contents);
+}
+
+static void
+test_restore(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", "third", NULL };
+  GError *error = NULL;
+  GPtrArray *notes = NULL;
+  NotificationHistory *history = notification_history_open(fixture->dir, MAX_RECORDS, MAX_FILE_SIZE,
+                                                           &notes, &error);
+  Notification *note = note_new("repeated");
+  gchar *restored;
+
+  g_assert_no_error(error);
+  g_assert_cmpuint(notes->len, ==, 0);
+  g_ptr_array_unref(notes);
+
+  notification_set_markup(note, g_strdup("<b>repeated</b>"));
+  notification_set_repeat_count(note, 3);
+  notification_history_append(history, note);
+  notification_unref(note);
+  notification_history_free(history);
+
+  history_write(fixture->dir, summaries);
+
+  history = notification_history_open(fixture->dir, MAX_RECORDS, MAX_FILE_SIZE, &notes, &error);
+  g_assert_no_error(error);
+  g_assert_cmpuint(notes->len, ==, 4);
+
+  note = g_ptr_array_index(notes, 0);
+  g_assert_cmpstr(notification_get_summary(note), ==, "repeated");
+  g_assert_cmpstr(notification_get_body(note), ==, "body");
+  g_assert_cmpstr(notification_get_app_name(note), ==, "test-app");
+  g_assert_cmpstr(notification_get_markup(note), ==, "<b>repeated</b>");
+  g_assert_cmpuint(notification_get_repeat_count(note), ==, 3);
+  g_assert_cmpuint(notification_get_history_index(note), ==, 1);
+
+  g_ptr_array_unref(notes);
+  notification_history_free(history);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "repeated,first,second,third");
+  g_free(restored);
+}
+
+static void
+test_torn_index(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", NULL };
+  const gchar *more[] = { "third", NULL };
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  /* A crash in the middle of writing the last record */
+  file_truncate(fixture->index_path, RECORD_SIZE / 2);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "first");
+  g_free(restored);
+
+  /* The torn record was cut off, so new records follow the intact ones */
+  history_write(fixture->dir, more);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "first,third");
+  g_free(restored);
+}
+
+static void
+test_torn_heap(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", NULL };
+  const gchar *more[] = { "third", NULL };
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  /* The strings of the last record only made it to disk in part */
+  file_truncate(fixture->heap_path, 3);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "first");
+  g_free(restored);
+
+  history_write(fixture->dir, more);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "first,third");
+  g_free(restored);
+}
+
+static void
+test_corrupt_record(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", "third", NULL };
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  /* The timestamp of the second record, which the checksum covers */
+  file_corrupt(fixture->index_path, HEADER_SIZE + RECORD_SIZE + 8);
+
+  /* Nothing after the first corrupt record is trusted */
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "first");
+  g_free(restored);
+}
+
+static void
+test_corrupt_heap(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", "third", NULL };
+  gchar *contents;
+  gchar *found;
+  gsize length;
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  g_assert_true(g_file_get_contents(fixture->heap_path, &contents, &length, NULL));
+  found = g_strstr_len(contents + HEADER_SIZE, length - HEADER_SIZE, "second");
+  g_assert_nonnull(found);
+
+  /* A flipped byte in the strings of the second record */
+  file_corrupt(fixture->heap_path, found - contents);
+  g_free(contents);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "first");
+  g_free(restored);
+}
+
+static void
+test_tombstone(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", "third", NULL };
+  NotificationHistory *history;
+  GPtrArray *notes = NULL;
+  GError *error = NULL;
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  /* Remove a notification restored from an earlier session */
+  history = notification_history_open(fixture->dir, MAX_RECORDS, MAX_FILE_SIZE, &notes, &error);
+  g_assert_no_error(error);
+  g_assert_cmpuint(notes->len, ==, 3);
+
+  notification_history_remove(history, g_ptr_array_index(notes, 1));
+  g_assert_cmpuint(notification_get_history_index(g_ptr_array_index(notes, 1)), ==, 0);
+
+  g_ptr_array_unref(notes);
+  notification_history_free(history);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "first,third");
+  g_free(restored);
+}
+
+static void
+test_clear(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", NULL };
+  const gchar *more[] = { "third", NULL };
+  NotificationHistory *history;
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  history = history_open(fixture->dir, &restored);
+  g_free(restored);
+  notification_history_clear(history);
+  notification_history_free(history);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "");
+  g_free(restored);
+
+  history_write(fixture->dir, more);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "third");
+  g_free(restored);
+}
+
+static void
+test_compact(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", "third", NULL };
+  const gchar *more[] = { "fourth", NULL };
+  NotificationHistory *history;
+  GPtrArray *notes = NULL;
+  GError *error = NULL;
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  history = notification_history_open(fixture->dir, MAX_RECORDS, MAX_FILE_SIZE, &notes, &error);
+  g_assert_no_error(error);
+
+  /* Keep all but the first */
+  g_ptr_array_remove_index(notes, 0);
+  g_assert_true(notification_history_compact(history, notes));
+  g_assert_cmpuint(notification_get_history_index(g_ptr_array_index(notes, 0)), ==, 1);
+
+  /* Tombstones written after compacting refer to the new records */
+  notification_history_remove(history, g_ptr_array_index(notes, 1));
+
+  g_ptr_array_unref(notes);
+  notification_history_free(history);
+
+  history_write(fixture->dir, more);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "second,fourth");
+  g_free(restored);
+}
+
+/**
+ * write_compacted:
+ * @fixture: the fixture
+ * @index_to: (nullable): where the compacted index ends up
+ * @heap_to: where the compacted heap ends up
+ *
+ * Writes a history holding "compacted" elsewhere and copies its files over,
+ * the way an interrupted compaction leaves them.
+ **/
+static void
+write_compacted(Fixture *fixture, const gchar *index_to, const gchar *heap_to)
+{
+  const gchar *summaries[] = { "compacted", NULL };
+  Fixture other;
+
+  fixture_set_up(&other, NULL);
+  history_write(other.dir, summaries);
+
+  if(index_to != NULL)
+    file_copy(other.index_path, index_to);
+  file_copy(other.heap_path, heap_to);
+
+  fixture_tear_down(&other, NULL);
+}
+
+static void
+test_compaction_before_renames(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", NULL };
+  gchar *index_tmp = g_strconcat(fixture->index_path, TMP_SUFFIX, NULL);
+  gchar *heap_tmp = g_strconcat(fixture->heap_path, TMP_SUFFIX, NULL);
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  /* Both new files were written, but neither replaced the old ones */
+  write_compacted(fixture, index_tmp, heap_tmp);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "first,second");
+  g_free(restored);
+
+  g_assert_false(g_file_test(index_tmp, G_FILE_TEST_EXISTS));
+  g_assert_false(g_file_test(heap_tmp, G_FILE_TEST_EXISTS));
+
+  g_free(index_tmp);
+  g_free(heap_tmp);
+}
+
+static void
+test_compaction_between_renames(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", NULL };
+  gchar *index_tmp = g_strconcat(fixture->index_path, TMP_SUFFIX, NULL);
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  /* The new heap replaced the old one, but the new index was not renamed */
+  write_compacted(fixture, index_tmp, fixture->heap_path);
+
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "compacted");
+  g_free(restored);
+
+  g_assert_false(g_file_test(index_tmp, G_FILE_TEST_EXISTS));
+
+  g_free(index_tmp);
+}
+
+static void
+test_mismatched_files(Fixture *fixture, gconstpointer user_data)
+{
+  const gchar *summaries[] = { "first", "second", NULL };
+  gchar *restored;
+
+  history_write(fixture->dir, summaries);
+
+  /* A heap from another generation is never read with this index */
+  write_compacted(fixture, NULL, fixture->heap_path);
+
+  g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "Discarding the unreadable*");
+  restored = history_reopen(fixture->dir);
+  g_test_assert_expected_messages();
+
+  g_assert_cmpstr(restored, ==, "");
+  g_free(restored);
+
+  /* The history is started over */
+  restored = history_reopen(fixture->dir);
+  g_assert_cmpstr(restored, ==, "");
+  g_free(restored);
+}
+
+int
+main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add("/history/restore", Fixture, NULL, fixture_set_up, test_restore, fixture_tear_down);
+  g_test_add("/history/torn-index", Fixture, NULL, fixture_set_up, test_torn_index, fixture_tear_down);
+  g_test_add("/history/torn-heap", Fixture, NULL, fixture_set_up, test_torn_heap, fixture_tear_down);
+  g_test_add("/history/corrupt-record", Fixture, NULL, fixture_set_up, test_corrupt_record, fixture_tear_down);
+  g_test_add("/history/corrupt-heap", Fixture, NULL, fixture_set_up, test_corrupt_heap, fixture_tear_down);
+  g_test_add("/history/tombstone", Fixture, NULL, fixture_set_up, test_tombstone, fixture_tear_down);
+  g_test_add("/history/clear", Fixture, NULL, fixture_set_up, test_clear, fixture_tear_down);
+  g_test_add("/history/compact", Fixture, NULL, fixture_set_up, test_compact, fixture_tear_down);
+  g_test_add("/history/compaction-before-renames", Fixture, NULL,
+             fixture_set_up, test_compaction_before_renames, fixture_tear_down);
+  g_test_add("/history/compaction-between-renames", Fixture, NULL,
+             fixture_set_up, test_compaction_between_renames, fixture_tear_down);
+  g_test_add("/history/mismatched-files", Fixture, NULL, fixture_set_up, test_mismatched_files, fixture_tear_down);
+
+  return g_test_run();
+}
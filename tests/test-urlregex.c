@@ -0,0 +1,143 @@
+/*
+ * test-urlregex.c - Check the spans the url patterns split bodies into.
+ */
+
+#include <string.h>
+#include "urlregex.h"
+
+typedef struct {
+  const gchar *body;
+
+  /* The spans, with each url written as [kind href|text] */
+  const gchar *expected;
+} SpanTest;
+
+static const SpanTest span_tests[] = {
+  { "", "" },
+  { "No links here, just text. Really", "No links here, just text. Really" },
+
+  /* The scheme pattern goes first, so the email pattern never sees the '@' */
+  { "mail http://user@example.com/path/to now",
+    "mail [url http://user@example.com/path/to|http://user@example.com/path/to] now" },
+
+  /* Nor does the www pattern see the host */
+  { "go to https://www.example.org/wiki/Main then",
+    "go to [url https://www.example.org/wiki/Main|https://www.example.org/wiki/Main] then" },
+  { "www.example.net and FTP.example.net",
+    "[www http://www.example.net|www.example.net] and [www http://FTP.example.net|FTP.example.net]" },
+
+  { "write to mailto:joe@example.com today",
+    "write to [email mailto:joe@example.com|mailto:joe@example.com] today" },
+  { "or joe.bloggs@example.co.uk, please",
+    "or [email mailto:joe.bloggs@example.co.uk|joe.bloggs@example.co.uk], please" },
+
+  { "fixes lp: #123 and LP: #42",
+    "fixes [lp https://bugs.launchpad.net/bugs/123|lp: #123] and [lp https://bugs.launchpad.net/bugs/42|LP: #42]" },
+  { "not lp:  #123 or lp:#123", "not lp:  #123 or lp:#123" },
+
+  /* Trailing punctuation is left out of the url */
+  { "See http://example.com.", "See [url http://example.com|http://example.com]." },
+  { "See http://example.com/page.", "See [url http://example.com/page|http://example.com/page]." },
+  { "(http://example.com/a_b)", "([url http://example.com/a_b|http://example.com/a_b])" },
+  { "ask joe@example.com.", "ask [email mailto:joe@example.com|joe@example.com]." },
+
+  { "http://a.example.com/one\twww.example.net\nfoo@example.com\r\nlp: #7",
+    "[url http://a.example.com/one|http://a.example.com/one]\t"
+    "[www http://www.example.net|www.example.net]\n"
+    "[email mailto:foo@example.com|foo@example.com]\r\n"
+    "[lp https://bugs.launchpad.net/bugs/7|lp: #7]" },
+};
+
+static const gchar *
+kind_name(MatchKind kind)
+{
+  switch(kind) {
+    case MATCH_AS_IS:
+      return "url";
+    case MATCH_DEFAULT_TO_HTTP:
+      return "www";
+    case MATCH_EMAIL:
+      return "email";
+    case MATCH_LP:
+      return "lp";
+    default:
+      g_assert_not_reached();
+  }
+}
+
+/**
+ * render_spans:
+ * @body: the body that was split
+ * @spans: its spans
+ *
+ * Checks that the spans cover the body in order, and writes them out in the
+ * form of SpanTest.expected.
+ **/
+static gchar *
+render_spans(const gchar *body, GArray *spans)
+{
+  GString *result = g_string_new(NULL);
+  gsize offset = 0;
+  guint i;
+
+  for(i = 0; i < spans->len; i++) {
+    const MatchSpan *span = &g_array_index(spans, MatchSpan, i);
+
+    g_assert_cmpuint(span->offset, ==, offset);
+    g_assert_cmpuint(span->length, >, 0);
+    offset += span->length;
+
+    if(span->kind == MATCH_NONE) {
+      /* Unmatched text is never split */
+      g_assert_true(i == 0 || g_array_index(spans, MatchSpan, i - 1).kind != MATCH_NONE);
+      g_string_append_len(result, body + span->offset, span->length);
+    }
+    else {
+      const gchar *target;
+      gsize target_length;
+      const gchar *prefix = urlregex_span_href(body, span, &target, &target_length);
+
+      g_string_append_printf(result, "[%s %s", kind_name(span->kind), prefix);
+      g_string_append_len(result, target, target_length);
+      g_string_append_c(result, '|');
+      g_string_append_len(result, body + span->offset, span->length);
+      g_string_append_c(result, ']');
+    }
+  }
+
+  g_assert_cmpuint(offset, ==, strlen(body));
+
+  return g_string_free(result, FALSE);
+}
+
+static void
+test_spans(gconstpointer user_data)
+{
+  const SpanTest *test = user_data;
+  GArray *spans = urlregex_get_spans();
+  gchar *rendered;
+
+  /* Leftovers from an earlier body must not show up */
+  g_array_set_size(spans, 3);
+
+  urlregex_find_spans(test->body, strlen(test->body), spans);
+  rendered = render_spans(test->body, spans);
+  g_assert_cmpstr(rendered, ==, test->expected);
+  g_free(rendered);
+}
+
+int
+main(int argc, char **argv)
+{
+  guint i;
+
+  g_test_init(&argc, &argv, NULL);
+
+  for(i = 0; i < G_N_ELEMENTS(span_tests); i++) {
+    gchar *path = g_strdup_printf("/urlregex/spans/%u", i);
+    g_test_add_data_func(path, &span_tests[i], test_spans);
+    g_free(path);
+  }
+
+  return g_test_run();
+}